@@ -283,6 +283,7 @@ EFI_STATUS EFIAPI efi_main(IN EFI_HANDLE image, IN EFI_SYSTEM_TABLE *st) {
             status = gBS->ExitBootServices(image, mapkey);
         } while (EFI_ERROR(status));
 
+        bootinfo.mmver = descriptorversion;
         page_init(&bootinfo, mmap, mmapsize, descriptorsize);
         // bootinfo.efiRT = st->RuntimeServices;
     }
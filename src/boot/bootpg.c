@@ -53,7 +53,7 @@ static uintptr_t ceil(uintptr_t n, size_t page_size) {
 static uintptr_t alloc_page(size_t n) {
     uintptr_t size = n * NATIVE_PAGE_SIZE;
     uintptr_t result = atomic_fetch_add(&bootinfo->static_start, size);
-    atomic_fetch_add(&bootinfo->free_memory, size);
+    atomic_fetch_sub(&bootinfo->free_memory, size);
     void *p = (void *)result;
     memset(p, 0, size);
     return result;
@@ -141,6 +141,9 @@ void page_init(moe_bootinfo_t *_bootinfo, void *mmap, size_t mmsize, size_t mmde
         }
     }
     bootinfo->total_memory = total_memory;
+    bootinfo->mmbase = (uintptr_t)mmap;
+    bootinfo->mmsize = mmsize;
+    bootinfo->mmdescsz = mmdescsz;
     bootinfo->static_start = kma_base;
     bootinfo->free_memory = kma_size * NATIVE_PAGE_SIZE;
 
@@ -156,3 +156,57 @@ typedef struct {
 } __attribute__((packed)) acpi_mcfg_t;
 
 #define ACPI_MCFG_SIGNATURE         "MCFG"
+
+//  SRAT System Resource Affinity Table
+typedef struct {
+    acpi_header_t   Header;
+    uint32_t    Reserved1;
+    uint64_t    Reserved2;
+    uint8_t     Structure[];
+} __attribute__((packed)) acpi_srat_t;
+
+typedef struct {
+    uint8_t     type, length;
+    uint8_t     proximity_domain_lo;
+    uint8_t     apic_id;
+    uint32_t    flags;
+    uint8_t     sapic_eid;
+    uint8_t     proximity_domain_hi[3];
+    uint32_t    clock_domain;
+} __attribute__((packed)) acpi_srat_lapic_t;
+
+typedef struct {
+    uint8_t     type, length;
+    uint32_t    proximity_domain;
+    uint16_t    Reserved1;
+    uint64_t    base_address;
+    uint64_t    length_bytes;
+    uint32_t    Reserved2;
+    uint32_t    flags;
+    uint64_t    Reserved3;
+} __attribute__((packed)) acpi_srat_memory_t;
+
+typedef struct {
+    uint8_t     type, length;
+    uint16_t    Reserved1;
+    uint32_t    proximity_domain;
+    uint32_t    x2apic_id;
+    uint32_t    flags;
+    uint32_t    clock_domain;
+    uint32_t    Reserved2;
+} __attribute__((packed)) acpi_srat_x2apic_t;
+
+#define ACPI_SRAT_SIGNATURE         "SRAT"
+#define ACPI_SRAT_LAPIC             0x00
+#define ACPI_SRAT_MEMORY            0x01
+#define ACPI_SRAT_X2APIC            0x02
+#define ACPI_SRAT_ENABLED           0x0001
+
+//  SLIT System Locality Distance Information Table
+typedef struct {
+    acpi_header_t   Header;
+    uint64_t    n_localities;
+    uint8_t     entry[];
+} __attribute__((packed)) acpi_slit_t;
+
+#define ACPI_SLIT_SIGNATURE         "SLIT"
@@ -41,6 +41,14 @@ typedef struct {
     uint64_t cmdline;
 } moe_bootinfo_t;
 
+// EFI memory descriptor as handed over in mmbase; mmdescsz is the stride
+typedef struct {
+    uint32_t type;
+    uint32_t pad;
+    uint64_t physical_start, virtual_start;
+    uint64_t n_pages, attribute;
+} efi_memory_descriptor_t;
+
 
 typedef void (*MOE_IRQ_HANDLER)(int irq);
 int moe_install_irq(uint8_t irq, MOE_IRQ_HANDLER handler);
@@ -61,18 +69,81 @@ void WRITE_PHYSICAL_UINT64(MOE_PHYSICAL_ADDRESS _p, uint64_t v);
 
 
 // Low Level Memory Manager
+#define MM_ZONE_DMA32   0x0001
+#define MM_ZERO         0x0002
+uintptr_t mm_alloc_pages(size_t n, unsigned flags);
+uintptr_t mm_alloc_pages_node(size_t n, unsigned flags, int node);
+int mm_get_number_of_nodes();
+int mm_node_of_cpu(int cpuid);
+int mm_node_of_pa(uintptr_t pa);
+int moe_get_current_node();
+uintptr_t smp_get_apicid(int cpuid);
+int mm_zero_pages();
 uintptr_t moe_alloc_physical_page(size_t n);
+void moe_free_physical_page(uintptr_t pa, size_t n);
 uintptr_t moe_alloc_gates_memory();
 uintptr_t moe_alloc_io_buffer(size_t size);
+typedef struct moe_dma_pool_t moe_dma_pool_t;
+moe_dma_pool_t *moe_dma_pool_create(const char *name, size_t size, size_t align, size_t boundary);
+void moe_dma_pool_destroy(moe_dma_pool_t *pool);
+void *moe_dma_pool_alloc(moe_dma_pool_t *pool, MOE_PHYSICAL_ADDRESS *pa);
+void moe_dma_pool_free(moe_dma_pool_t *pool, void *va);
+void *mm_init_cpu(int cpuid);
+void *moe_get_cpu_mm();
+void mm_reclaim_boot_memory();
 
 uint64_t pg_get_pte(uintptr_t ptr, int level);
 void pg_set_pte(uintptr_t ptr, uint64_t pte, int level);
-int smp_send_invalidate_tlb();
+
+#define TLB_BATCH_SIZE          16
+#define TLB_INVLPG_THRESHOLD    32
+typedef struct {
+    uintptr_t va;
+    size_t size;
+} tlb_range_t;
+typedef struct {
+    int n_ranges, flush_all;
+    tlb_range_t ranges[TLB_BATCH_SIZE];
+} tlb_batch_t;
+void tlb_batch_add(tlb_batch_t *batch, uintptr_t va, size_t size);
+void tlb_batch_flush(tlb_batch_t *batch);
+void tlb_flush_local(const tlb_batch_t *batch);
+int smp_send_invalidate_tlb(const tlb_batch_t *batch);
+
+typedef struct {
+    uintptr_t irqs, ticks_avoided, idle_timers, wakeups;
+} smp_tick_stat_t;
+int smp_stop_tick(int64_t us);
+void smp_restart_tick(void);
+void smp_send_reschedule(int cpuid);
+int smp_is_tickless(void);
+void smp_get_tick_stat(int cpuid, smp_tick_stat_t *stat);
+int moe_get_boot_option(const char *name);
+
+typedef struct {
+    uintptr_t ptes_written, tables_created;
+    uintptr_t invlpg_flushes, full_flushes, shootdowns;
+    uintptr_t direct_map_size, direct_map_page_size;
+} pg_stat_t;
+void *pg_map_range(uintptr_t base_pa, void *base_va, size_t size, uint64_t attributes);
+void pg_unmap_range(void *base_va, size_t size);
+void pg_protect_range(void *base_va, size_t size, uint64_t attributes);
+void pg_get_stat(pg_stat_t *stat);
 void *pg_map_mmio(uintptr_t base, size_t size);
 void *pg_valloc(uintptr_t pa, size_t size);
+void *pg_valloc_guarded(uintptr_t pa, size_t size);
+size_t pg_vfree(void *va);
+void pg_get_vm_info(size_t *n_areas, size_t *size, size_t *n_free);
+uintptr_t pg_va2pa(void *va);
 void *pg_map_vram(uintptr_t base, size_t size);
 void *pg_map_user(uintptr_t base, size_t size, int reserved);
 
+// Thread counts for scaling benchmarks: doubles from 1 and ends at max_threads, then returns 0
+static inline int bench_next_threads(int n_threads, int max_threads) {
+    if (n_threads >= max_threads) return 0;
+    return (n_threads * 2 < max_threads) ? n_threads * 2 : max_threads;
+}
+
 
 //  ACPI
 void* acpi_find_table(const char* signature);
@@ -18,6 +18,7 @@ int snprintf(char* buffer, size_t n, const char* format, ...);
 char *strchr(const char *s, int c);
 char *strncpy(char *s1, const char *s2, size_t n);
 int strncmp(const char *s1, const char *s2, size_t n);
+int atoi(const char *s);
 size_t strlen(const char *s);
 void *memcpy(void *p, const void *q, size_t n);
 void *memset(void *p, int v, size_t n);
@@ -72,6 +73,14 @@ int moe_set_console_cursor_visible(void *context, int visible);
 
 //  Minimal Memory Subsystem
 void *moe_alloc_object(size_t size, size_t count);
+void moe_free_object(void *ptr);
+
+typedef struct moe_cache_t moe_cache_t;
+typedef void (*MOE_CACHE_CTOR)(void *obj);
+moe_cache_t *moe_cache_create(const char *name, size_t size, size_t align, MOE_CACHE_CTOR ctor);
+void moe_cache_destroy(moe_cache_t *cache);
+void *moe_cache_alloc(moe_cache_t *cache);
+void moe_cache_free(moe_cache_t *cache, void *obj);
 
 #define PROT_READ   0x1
 #define PROT_WRITE  0x2
@@ -106,11 +115,14 @@ typedef enum {
     priority_max,
 } moe_priority_level_t;
 
+#define MOE_DEFAULT_STACK_SIZE  0x10000
 typedef void (*moe_thread_start)(void *args);
 int moe_create_thread(moe_thread_start start, moe_priority_level_t priority, void *args, const char *name);
+int moe_create_thread_with_stack(moe_thread_start start, moe_priority_level_t priority, void *args, const char *name, size_t stack_size);
 int moe_usleep(int64_t us);
 int moe_get_current_thread_id(void);
 const char *moe_get_current_thread_name(void);
+int moe_set_thread_affinity(int thid, uint32_t mask);
 _Noreturn void moe_exit_thread(uint32_t exit_code);
 int moe_get_number_of_active_cpus(void);
 
@@ -118,11 +130,39 @@ int moe_get_pid(void);
 int moe_raise_pid(void);
 int moe_create_process(moe_thread_start start, moe_priority_level_t priority, void *args, const char *name);
 
+// Fibers run cooperatively inside the thread that created them and must be joined by it
+typedef struct moe_fiber_t moe_fiber_t;
+#define MOE_FIBER_STACK_SIZE    0x4000
+typedef int (*moe_fiber_start)(void *args);
+moe_fiber_t *moe_create_fiber(moe_fiber_start start, void *args, size_t stack_size);
+void moe_yield_fiber(void);
+int moe_switch_fiber(moe_fiber_t *fiber);
+int moe_sleep_fiber(int64_t us);
+int moe_join_fiber(moe_fiber_t *fiber, int *exit_code);
+_Noreturn void moe_exit_fiber(int exit_code);
+int moe_get_current_fiber_id(void);
+
+// Deferred work runs on pooled worker threads of the CPU that queued it; NULL is the system queue
+typedef struct moe_work_queue_t moe_work_queue_t;
+typedef struct moe_work_t moe_work_t;
+typedef void (*moe_work_func)(void *args);
+moe_work_queue_t *moe_work_queue_create(const char *name, moe_priority_level_t priority);
+moe_work_t *moe_create_work(moe_work_func func, void *args);
+void moe_destroy_work(moe_work_t *work);
+int moe_queue_work(moe_work_queue_t *wq, moe_work_t *work);
+int moe_queue_delayed_work(moe_work_queue_t *wq, moe_work_t *work, int64_t us);
+int moe_cancel_work(moe_work_t *work);
+void moe_flush_work(moe_work_t *work);
+void moe_flush_work_queue(moe_work_queue_t *wq);
+
 
 typedef _Atomic uintptr_t moe_spinlock_t;
 int moe_spinlock_try(moe_spinlock_t *lock);
 int moe_spinlock_acquire(moe_spinlock_t *lock);
 void moe_spinlock_release(moe_spinlock_t *lock);
+uintptr_t moe_spinlock_acquire_irq(moe_spinlock_t *lock);
+void moe_spinlock_release_irq(moe_spinlock_t *lock, uintptr_t flags);
+void moe_spinlock_register(moe_spinlock_t *lock, const char *name);
 
 typedef struct moe_semaphore_t moe_semaphore_t;
 moe_semaphore_t *moe_sem_create(intptr_t value);
@@ -140,6 +180,10 @@ int64_t moe_measure_diff(moe_measure_t from);
 
 typedef struct moe_queue_t moe_queue_t;
 moe_queue_t *moe_queue_create(size_t capacity);
+// Promises that only one context at a time writes or reads, which saves the CAS on that side
+#define MOE_QUEUE_SINGLE_PRODUCER   0x0001
+#define MOE_QUEUE_SINGLE_CONSUMER   0x0002
+moe_queue_t *moe_queue_create_with_flags(size_t capacity, int flags);
 intptr_t moe_queue_read(moe_queue_t *self, intptr_t default_val);
 int moe_queue_wait(moe_queue_t* self, intptr_t* result, uint64_t us);
 int moe_queue_write(moe_queue_t *self, intptr_t data);
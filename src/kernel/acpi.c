@@ -188,10 +188,17 @@ uint32_t acpi_read_pm_timer() {
     return value & pm_timer_mask;
 }
 
-void acpi_init(acpi_rsd_ptr_t* _rsdp) {
+// Makes acpi_find_table usable before the memory manager is up
+void acpi_early_init(acpi_rsd_ptr_t* _rsdp) {
     rsdp = _rsdp;
     xsdt = (acpi_xsdt_t*)MOE_PA2VA(rsdp->xsdtaddr);
     n_entries_xsdt = (xsdt->Header.length - 0x24 /* offset_of Entry */ ) / sizeof(xsdt->Entry[0]);
+}
+
+void acpi_init(acpi_rsd_ptr_t* _rsdp) {
+    if (!xsdt) {
+        acpi_early_init(_rsdp);
+    }
 
     fadt = moe_alloc_object(sizeof(acpi_fadt_t), 1);
     moe_assert(fadt, "FADT NOT FOUND");
@@ -267,6 +267,7 @@ static void idt_init() {
 #define MSI_BASE                    0xFEE00000
 
 #define APIC_REDIR_MASK             0x00010000
+#define APIC_ICR_PENDING            0x00001000
 
 
 // type 00 Processor Local APIC
@@ -299,6 +300,8 @@ apic_madt_ovr_t gsi_table[MAX_IRQ];
 
 apic_id_t apic_ids[MAX_CPU];
 uint8_t apicid_to_cpuids[256];
+apic_id_t cpuid_to_apicids[MAX_CPU];
+_Atomic uint32_t smp_online_cpus = 0;
 int n_cpu = 0;
 MOE_PHYSICAL_ADDRESS lapic_base = 0;
 void *ioapic_base = NULL;
@@ -309,6 +312,17 @@ uint64_t lapic_freq = 0;
 uint32_t lapic_timer_div = 0;
 _Atomic uint64_t lapic_timer_value = 0;
 
+uintptr_t smp_get_current_cpuid();
+
+// Every CPU ticks on its own. Idle APs without timers stop ticking, and in tickless
+// mode idle APs with timers use a one-shot timer instead of the periodic tick
+int smp_tickless = 0;
+_Atomic uint32_t smp_tick_stopped = 0;
+static struct {
+    _Atomic uintptr_t irqs, ticks_avoided, idle_timers, wakeups;
+    moe_measure_t stopped_at;
+} tick_stat[MAX_CPU];
+
 
 static void apic_write_ioapic(int _index, uint32_t value) {
     _Atomic uint32_t *index = (void *)((uintptr_t)ioapic_base);
@@ -395,6 +409,7 @@ uint8_t moe_make_msi_data(int irq, int mode, uint64_t *addr, uint32_t *data) {
 }
 
 void _irq_main(uint8_t irq, void* p) {
+    tick_stat[smp_get_current_cpuid()].irqs++;
     MOE_IRQ_HANDLER handler = irq_handler[irq];
     if (handler) {
         handler(irq);
@@ -410,13 +425,18 @@ void _irq_main(uint8_t irq, void* p) {
     }
 }
 
+static void apic_send_ipi(apic_id_t destination, uint8_t vector) {
+    while (apic_read_lapic(0x300) & APIC_ICR_PENDING) {
+        cpu_relax();
+    }
+    apic_write_lapic(0x310, destination << 24);
+    apic_write_lapic(0x300, 0x4000 + vector);
+}
+
 void irq_livt() {
     lapic_timer_value++;
     apic_end_of_irq(0);
     thread_reschedule();
-    if (smp_mode) {
-        apic_write_lapic(0x300, 0xC0000 + IRQ_SCHEDULE);
-    }
 }
 
 moe_measure_t lapic_create_measure(int64_t us) {
@@ -431,23 +451,129 @@ int64_t lapic_measure_diff(moe_measure_t from) {
     return (atomic_load(&lapic_timer_value) - from) * 1000;
 }
 
-int smp_send_invalidate_tlb() {
-    // if (smp_mode) {
-    //     apic_write_lapic(0x300, 0xC0000 + IRQ_INVALIDATE_TLB);
-    //     moe_usleep(10000);
-    // }
-    return 0;
+
+/*********************************************************************/
+// TLB Shootdown
+
+static struct {
+    moe_spinlock_t lock;
+    const tlb_batch_t *_Atomic batch;
+    _Atomic uint32_t targets;
+    _Atomic int pending;
+} tlb_shootdown;
+
+// Flushes the current request if it still targets this CPU
+static void tlb_shootdown_ack(uintptr_t cpuid) {
+    uint32_t bit = UINT32_C(1) << cpuid;
+    if (atomic_fetch_and(&tlb_shootdown.targets, ~bit) & bit) {
+        tlb_flush_local(atomic_load(&tlb_shootdown.batch));
+        atomic_fetch_sub(&tlb_shootdown.pending, 1);
+    }
 }
 
-void ipi_invtlb_main(uintptr_t cr3) {
+int smp_send_invalidate_tlb(const tlb_batch_t *batch) {
+    if (!smp_mode) return 0;
+    uintptr_t flags = io_lock_irq();
+    uintptr_t cpuid = smp_get_current_cpuid();
+    uint32_t targets = atomic_load(&smp_online_cpus) & ~(UINT32_C(1) << cpuid);
+    int n_targets = __builtin_popcount(targets);
+    if (n_targets) {
+        // Whoever holds the lock may be waiting for us, so keep answering while spinning
+        while (!moe_spinlock_try(&tlb_shootdown.lock)) {
+            tlb_shootdown_ack(cpuid);
+            cpu_relax();
+        }
+        atomic_store(&tlb_shootdown.batch, batch);
+        atomic_store(&tlb_shootdown.pending, n_targets);
+        atomic_store(&tlb_shootdown.targets, targets);
+        for (int i = 0; i < MAX_CPU; i++) {
+            if (targets & (UINT32_C(1) << i)) {
+                apic_send_ipi(cpuid_to_apicids[i], IRQ_INVALIDATE_TLB);
+            }
+        }
+        while (atomic_load(&tlb_shootdown.pending) > 0) {
+            cpu_relax();
+        }
+        atomic_store(&tlb_shootdown.batch, NULL);
+        moe_spinlock_release(&tlb_shootdown.lock);
+    }
+    io_restore_irq(flags);
+    return n_targets;
+}
+
+void ipi_invtlb_main() {
+    uintptr_t cpuid = smp_get_current_cpuid();
+    tick_stat[cpuid].irqs++;
+    tlb_shootdown_ack(cpuid);
     apic_end_of_irq(0);
 }
 
+// Both the AP timer ticks and reschedule IPIs arrive here
 void ipi_sche_main() {
+    tick_stat[smp_get_current_cpuid()].irqs++;
     apic_end_of_irq(0);
     thread_reschedule();
 }
 
+
+/*********************************************************************/
+// Tickless Idle
+
+int smp_is_tickless() {
+    return smp_tickless;
+}
+
+// Stops the ticks of the current idle AP and arms a one-shot timer for us (<0: none)
+// Without tickless mode it stops them only when there is no timer; returns 0 if still ticking
+// Must be called with interrupts disabled
+int smp_stop_tick(int64_t us) {
+    if (!smp_tickless && us >= 0) return 0;
+    uintptr_t cpuid = smp_get_current_cpuid();
+    if (!cpuid) return 0;
+    if (!(atomic_fetch_or(&smp_tick_stopped, UINT32_C(1) << cpuid) & (UINT32_C(1) << cpuid))) {
+        tick_stat[cpuid].stopped_at = moe_create_measure(0);
+    }
+    if (us >= 0) {
+        // Longer waits fire when the 32-bit count runs out, and the idle thread re-arms for the rest
+        uint64_t count = UINT32_MAX;
+        if (!lapic_freq || (uint64_t)us <= UINT64_MAX / lapic_freq) {
+            count = MIN((uint64_t)us * lapic_freq / 1000000, UINT32_MAX);
+        }
+        apic_write_lapic(0x320, IRQ_SCHEDULE);
+        apic_write_lapic(0x380, MAX(MIN(count, UINT32_MAX), 1));
+        tick_stat[cpuid].idle_timers++;
+    } else {
+        apic_write_lapic(0x380, 0);
+    }
+    return 1;
+}
+
+// Goes back to the periodic tick on the current AP
+void smp_restart_tick() {
+    uintptr_t cpuid = smp_get_current_cpuid();
+    apic_write_lapic(0x320, 0x00020000 | IRQ_SCHEDULE);
+    apic_write_lapic(0x380, lapic_timer_div);
+    if (atomic_fetch_and(&smp_tick_stopped, ~(UINT32_C(1) << cpuid)) & (UINT32_C(1) << cpuid)) {
+        tick_stat[cpuid].ticks_avoided += moe_measure_diff(tick_stat[cpuid].stopped_at) / 1000;
+    }
+}
+
+// Sends a reschedule IPI to the CPU
+void smp_send_reschedule(int cpuid) {
+    if (!smp_mode) return;
+    uintptr_t flags = io_lock_irq();
+    tick_stat[cpuid].wakeups++;
+    apic_send_ipi(cpuid_to_apicids[cpuid], IRQ_SCHEDULE);
+    io_restore_irq(flags);
+}
+
+void smp_get_tick_stat(int cpuid, smp_tick_stat_t *stat) {
+    stat->irqs = tick_stat[cpuid].irqs;
+    stat->ticks_avoided = tick_stat[cpuid].ticks_avoided;
+    stat->idle_timers = tick_stat[cpuid].idle_timers;
+    stat->wakeups = tick_stat[cpuid].wakeups;
+}
+
 apic_id_t apic_read_apicid() {
     return apic_read_lapic(0x020) >> 24;
 }
@@ -467,6 +593,10 @@ uintptr_t smp_get_current_cpuid() {
     return smp_get_current_cpuid_apic();
 }
 
+uintptr_t smp_get_apicid(int cpuid) {
+    return cpuid_to_apicids[cpuid];
+}
+
 
 // Initialize Application Processor (SMP)
 void smp_init_ap(uint8_t cpuid) {
@@ -483,11 +613,13 @@ void smp_init_ap(uint8_t cpuid) {
 
     apic_id_t apicid = apic_read_apicid();
     apicid_to_cpuids[apicid] = cpuid;
+    cpuid_to_apicids[cpuid] = apicid;
+    atomic_fetch_or(&smp_online_cpus, UINT32_C(1) << cpuid);
 
     apic_write_lapic(0x0F0, 0x10F);
 
     apic_write_lapic(0x3E0, 0x0000000B);
-    apic_write_lapic(0x320, 0x00030000 | IRQ_LAPIC_TIMER);
+    apic_write_lapic(0x320, 0x00020000 | IRQ_SCHEDULE);
     apic_write_lapic(0x380, lapic_timer_div);
 }
 
@@ -518,6 +650,8 @@ static void apic_init() {
         msr_lapic.u64 |= IA32_APIC_BASE_MSR_ENABLE;
         cpu_wrmsr(IA32_APIC_BASE_MSR, msr_lapic);
         lapic_base = msr_lapic.u64 & ~0xFFF;
+        cpuid_to_apicids[0] = apic_read_apicid();
+        atomic_store(&smp_online_cpus, 1);
         pg_map_mmio(lapic_base, 1);
 
         apic_ids[n_cpu++] = apic_read_apicid();
@@ -628,7 +762,7 @@ static void apic_init() {
         idt_set_kernel_handler(IRQ_BASE + 47, (uintptr_t)&_irq47, 0, 0);
 
         idt_set_kernel_handler(IRQ_SCHEDULE, (uintptr_t)&_ipi_sche, 0, 0);
-        // idt_set_kernel_handler(IRQ_INVALIDATE_TLB, (uintptr_t)&_ipi_invtlb, 0, 0);
+        idt_set_kernel_handler(IRQ_INVALIDATE_TLB, (uintptr_t)&_ipi_invtlb, 0, 0);
 
 
         // HPET, Local APIC Timer
@@ -674,6 +808,7 @@ static void apic_init() {
         }
 
         lapic_timer_div = lapic_freq / 1000;
+        smp_tickless = moe_get_boot_option("tickless");
         irq_handler[0] = &irq_livt;
         apic_write_lapic(0x320, 0x00020000 | IRQ_LAPIC_TIMER);
         apic_write_lapic(0x380, lapic_timer_div);
@@ -698,6 +833,7 @@ static void apic_init() {
             thread_init(1);
         }
     }
+    moe_spinlock_register(&tlb_shootdown.lock, "tlb_shootdown");
 }
 
 
@@ -47,8 +47,10 @@
     extern _irq_main
     extern smp_init_ap
     extern ipi_sche_main
+    extern ipi_invtlb_main
     extern thread_on_start
     extern moe_exit_thread
+    extern moe_exit_fiber
     extern arch_syscall_entry
 
 
@@ -319,6 +321,52 @@ _new_thread:
     ud2
 
 
+; void _do_switch_fiber(fiber_context_t *from, fiber_context_t *to);
+; Fibers share their thread's FPU state and kernel stack, so only callee-saved registers move
+    global _do_switch_fiber
+_do_switch_fiber:
+    mov [rcx + CTX_SP], rsp
+    mov [rcx + CTX_BP], rbp
+    mov [rcx + CTX_BX], rbx
+    mov [rcx + CTX_SI], rsi
+    mov [rcx + CTX_DI], rdi
+    mov [rcx + CTX_R12], r12
+    mov [rcx + CTX_R13], r13
+    mov [rcx + CTX_R14], r14
+    mov [rcx + CTX_R15], r15
+
+    mov rsp, [rdx + CTX_SP]
+    mov rbp, [rdx + CTX_BP]
+    mov rbx, [rdx + CTX_BX]
+    mov rsi, [rdx + CTX_SI]
+    mov rdi, [rdx + CTX_DI]
+    mov r12, [rdx + CTX_R12]
+    mov r13, [rdx + CTX_R13]
+    mov r14, [rdx + CTX_R14]
+    mov r15, [rdx + CTX_R15]
+    ret
+
+
+; void io_setup_new_fiber(fiber_context_t *context, uintptr_t* new_sp, moe_fiber_start start, void *args);
+    global io_setup_new_fiber
+io_setup_new_fiber:
+    lea rax, [rel _new_fiber]
+    sub rdx, BYTE 0x18
+    mov [rdx], rax
+    mov [rdx + 0x08], r8
+    mov [rdx + 0x10], r9
+    mov [rcx + CTX_SP], rdx
+    ret
+
+_new_fiber:
+    pop rax
+    pop rcx
+    call rax
+    mov ecx, eax
+    call moe_exit_fiber
+    ud2
+
+
 ; void io_set_lazy_fpu_restore();
     global io_set_lazy_fpu_restore
 io_set_lazy_fpu_restore:
@@ -686,6 +734,28 @@ _ipi_sche:
     pop rax
     iretq
 
+    global _ipi_invtlb
+_ipi_invtlb:
+    push rax
+    push rcx
+    push rdx
+    push r8
+    push r9
+    push r10
+    push r11
+    cld
+
+    call ipi_invtlb_main
+
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
+
 
 ; _Atomic uint32_t *smp_setup_init(uint8_t vector_sipi, int max_cpu, size_t stack_chunk_size, uintptr_t* stack_base);
     global smp_setup_init
@@ -7,6 +7,7 @@
 #include "kernel.h"
 
 
+extern void acpi_early_init(void *);
 extern void acpi_init(void *);
 extern void arch_init(moe_bootinfo_t* info);
 extern void arch_delayed_init(void);
@@ -16,6 +17,7 @@ extern void page_init(moe_bootinfo_t *bootinfo);
 extern void xhci_init(void);
 extern void pg_enter_strict_mode(void);
 extern void hid_init(void);
+extern void workq_init(void);
 extern void shell_start(const wchar_t *cmdline);
 
 extern int vsnprintf(char *buffer, size_t limit, const char *format, va_list args);
@@ -81,6 +83,8 @@ void _zputs(const char *s) {
 /*********************************************************************/
 
 moe_bootinfo_t bootinfo;
+// Copy of the command line once the loader data holding it is reclaimed
+static const wchar_t *boot_cmdline;
 
 void *moe_kname(char *buffer, size_t limit) {
     snprintf(buffer, limit, "MEG-OS v0.7.0 (codename neapolis) [%d Cores, Memory %dMB]\n",
@@ -88,21 +92,57 @@ void *moe_kname(char *buffer, size_t limit) {
     return buffer;
 }
 
+// Tests for a word in the command line
+int moe_get_boot_option(const char *name) {
+    const wchar_t *p = boot_cmdline;
+    if (!p) {
+        if (!bootinfo.cmdline) return 0;
+        p = MOE_PA2VA(bootinfo.cmdline);
+    }
+    size_t len = strlen(name);
+    while (*p) {
+        while (*p == ' ') p++;
+        size_t i = 0;
+        while (i < len && p[i] == (unsigned char)name[i]) i++;
+        if (i == len && (p[i] == ' ' || p[i] == 0)) return 1;
+        while (*p && *p != ' ') p++;
+    }
+    return 0;
+}
+
 void sysinit(void *args) {
     moe_bootinfo_t *info = args;
 
+    workq_init();
     hid_init();
     xhci_init();
     arch_delayed_init();
 
+    // The command line lives in loader data, so keep a copy before reclaiming it
     MOE_PHYSICAL_ADDRESS pa_cmdline = info->cmdline;
-    shell_start(pa_cmdline ? MOE_PA2VA(pa_cmdline) : NULL);
+    wchar_t *cmdline = NULL;
+    if (pa_cmdline) {
+        const wchar_t *p = MOE_PA2VA(pa_cmdline);
+        size_t len = 0;
+        while (p[len]) len++;
+        cmdline = moe_alloc_object(sizeof(wchar_t), len + 1);
+        if (cmdline) {
+            memcpy(cmdline, p, len * sizeof(wchar_t));
+            cmdline[len] = 0;
+        }
+    }
+    boot_cmdline = cmdline;
+    info->cmdline = 0;
+    mm_reclaim_boot_memory();
+
+    shell_start(cmdline);
 }
 
 static _Noreturn void start_kernel() {
 
-    mm_init(&bootinfo);
     page_init(&bootinfo);
+    acpi_early_init((void *)bootinfo.acpi);
+    mm_init(&bootinfo);
     gs_init(&bootinfo);
     acpi_init((void *)bootinfo.acpi);
     arch_init(&bootinfo);
@@ -37,6 +37,7 @@ typedef enum {
 #define PS2_FIFO_MOUSE_MAX  0x2FF
 
 static moe_queue_t *ps2_event_queue;
+static moe_work_t *ps2_work;
 
 static volatile uintptr_t ps2k_state = 0;
 
@@ -135,12 +136,14 @@ void ps2k_irq_handler(int irq) {
     uint32_t ps2k = ps2_read_data();
     // printf("K(%02x)", ps2k);
     moe_queue_write(ps2_event_queue, PS2_FIFO_KEY_MIN + ps2k);
+    moe_queue_work(NULL, ps2_work);
     ps2_clear_interrupt();
 }
 
 
 void ps2m_irq_handler(int irq) {
     moe_queue_write(ps2_event_queue, PS2_FIFO_MOUSE_MIN + ps2_read_data());
+    moe_queue_work(NULL, ps2_work);
     ps2_clear_interrupt();
 }
 
@@ -217,34 +220,32 @@ static ps2_state_t ps2_parse_data(intptr_t data, hid_raw_kbd_report_t *keyreport
 }
 
 
-// PS2 to HID Thread
-_Noreturn void ps2_hid_thread(void *args) {
+// PS2 to HID, deferred from the IRQ handlers; a work never runs twice at once
+static void ps2_hid_work(void *args) {
 
-    moe_hid_kbd_state_t keystate = {{0}};
-    moe_hid_mos_state_t mouse = {{{0}}};
-    for (;;) {
-        int cont;
-        do {
+    static moe_hid_kbd_state_t keystate = {{0}};
+    static moe_hid_mos_state_t mouse = {{{0}}};
+    static int cont = 0;
+    intptr_t ps2_data;
+    while ((ps2_data = moe_queue_read(ps2_event_queue, 0))) {
+        if (!cont) {
             memset(&keystate.current, 0, sizeof(hid_raw_kbd_report_t));
-            cont = 0;
-            intptr_t ps2_data;
-            if (moe_queue_wait(ps2_event_queue, &ps2_data, MOE_FOREVER)) {
-                ps2_state_t state = ps2_parse_data(ps2_data, &keystate.current, &mouse);
-                switch(state) {
-                    case ps2_state_nodata:
-                        break;
-                    case ps2_state_key:
-                        hid_process_key_report(&keystate);
-                        break;
-                    case ps2_state_mouse:
-                        hid_process_mouse_report(&mouse);
-                        break;
-                    case ps2_state_continued:
-                        cont = 1;
-                        break;
-                }
-            }
-        } while (cont);
+        }
+        cont = 0;
+        ps2_state_t state = ps2_parse_data(ps2_data, &keystate.current, &mouse);
+        switch(state) {
+            case ps2_state_nodata:
+                break;
+            case ps2_state_key:
+                hid_process_key_report(&keystate);
+                break;
+            case ps2_state_mouse:
+                hid_process_mouse_report(&mouse);
+                break;
+            case ps2_state_continued:
+                cont = 1;
+                break;
+        }
     }
 }
 
@@ -261,7 +262,8 @@ static int ps2_init() {
     }
 
     uintptr_t size_of_buffer = 128;
-    ps2_event_queue = moe_queue_create(size_of_buffer);
+    ps2_event_queue = moe_queue_create_with_flags(size_of_buffer, MOE_QUEUE_SINGLE_CONSUMER);
+    ps2_work = moe_create_work(&ps2_hid_work, NULL);
 
     if (ps2_wait_for_write(1) != 0) goto ps2_timeout_error;
     ps2_write_command(0x60);
@@ -281,7 +283,6 @@ static int ps2_init() {
 
     moe_install_irq(1, &ps2k_irq_handler);
     moe_install_irq(12, &ps2m_irq_handler);
-    moe_create_thread(&ps2_hid_thread, priority_realtime, 0, "ps2.hid");
 
     return 1;
 
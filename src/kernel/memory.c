@@ -7,9 +7,48 @@
 #include "kernel.h"
 
 
+#define PAGE_SHIFT          12
+#define PAGE_SIZE           0x1000
+#define MAX_ORDER           19
+#define INVALID_PFN         UINTPTR_MAX
+#define PF_ORDER_MASK       0x1F
+#define PF_SLAB             0x40
+#define PF_FREE             0x80
+#define PGBENCH_SLOTS       256
+
+#define LOW_MEMORY_PFN      0x100
+#define DMA32_LIMIT_PFN     (UINT64_C(0x100000000) >> PAGE_SHIFT)
+#define EFI_LOADER_DATA             2
+#define EFI_BOOT_SERVICES_CODE      3
+#define EFI_BOOT_SERVICES_DATA      4
+#define EFI_CONVENTIONAL_MEMORY     7
+
+#define CACHE_LINE_SIZE     64
+#define CACHE_NAME_SIZE     24
+#define SLAB_MIN_ALIGN      16
+#define MAX_SLAB_ORDER      3
+#define MAX_EMPTY_SLABS     1
+#define MIN_SIZE_CLASS      16
+#define MAX_SIZE_CLASS      2048
+#define N_SIZE_CLASSES      8
+
+#define MAG_PAGES           64
+#define MAG_PAGE_BATCH      32
+#define MAG_BATCH_ORDER     5
+#define MAG_OBJECTS         32
+#define MAG_OBJECT_BATCH    16
+#define MAX_MAG_CACHES      32
+#define MMBENCH_BATCH       16
+
+#define MAX_NODES           4
+#define MAX_NUMA_RANGES     32
+#define LOCAL_DISTANCE      10
+#define REMOTE_DISTANCE     20
+
+#define ZERO_POOL_PAGES     512
+#define ZERO_BATCH          32
+
 uintptr_t total_memory = 0;
-static _Atomic uintptr_t free_memory;
-static _Atomic uintptr_t static_start;
 static _Atomic uint32_t gates_memory_bitmap[MAX_GATES_INDEX];
 
 static uintptr_t ceil_pagesize(size_t n) {
@@ -45,6 +84,383 @@ void moe_release(moe_shared_t *self, MOE_DEALLOC dealloc) {
 }
 
 
+/*********************************************************************/
+// Buddy Page Allocator
+
+typedef struct free_block_t free_block_t;
+struct free_block_t {
+    free_block_t *next, *prev;
+};
+
+typedef struct {
+    moe_spinlock_t lock;
+    free_block_t head;
+    _Atomic uintptr_t count;
+} __attribute__((aligned(64))) free_area_t;
+
+// Pages zeroed in the background by page_process
+typedef struct {
+    moe_spinlock_t lock;
+    uint32_t count;
+    _Atomic uintptr_t hits, misses, zeroed;
+    uintptr_t pfns[ZERO_POOL_PAGES];
+} zero_pool_t;
+
+typedef struct {
+    const char *name;
+    int node;
+    uintptr_t base_pfn, end_pfn;
+    _Atomic uint8_t *pf;
+    _Atomic uintptr_t free_pages;
+    _Atomic uintptr_t n_alloc, n_free;
+    uintptr_t managed_pages, reclaimed_pages;
+    free_area_t area[MAX_ORDER];
+    zero_pool_t zero_pool;
+} mm_zone_t;
+
+// Each node has one zone of each type; zones[node * MAX_ZONE_TYPES + type]
+enum {
+    ZONE_DMA32,
+    ZONE_NORMAL,
+    MAX_ZONE_TYPES,
+};
+#define MAX_ZONES   (MAX_NODES * MAX_ZONE_TYPES)
+static mm_zone_t zones[MAX_ZONES];
+
+// Node topology from SRAT/SLIT; without them everything belongs to node 0
+typedef struct {
+    uintptr_t base_pfn, end_pfn;
+    int node;
+} numa_range_t;
+
+static struct {
+    int n_nodes, n_ranges;
+    uint32_t domains[MAX_NODES];
+    uint8_t distance[MAX_NODES][MAX_NODES];
+    uint8_t apic_node[256];
+    numa_range_t ranges[MAX_NUMA_RANGES];
+    // Zones in allocation order for each node: normal zones by distance, then DMA32 zones
+    uint8_t zonelist[MAX_NODES][MAX_ZONES];
+} numa;
+
+typedef struct {
+    uintptr_t pfn, n_pages;
+} mm_range_t;
+
+static mm_range_t *boot_ranges;
+static uintptr_t n_boot_ranges;
+
+
+static mm_zone_t *zone_of_pfn(uintptr_t pfn) {
+    for (int i = 0; i < MAX_ZONES; i++) {
+        mm_zone_t *zone = &zones[i];
+        if (pfn >= zone->base_pfn && pfn < zone->end_pfn) return zone;
+    }
+    return NULL;
+}
+
+static int numa_node_of_pfn(uintptr_t pfn) {
+    for (int i = 0; i < numa.n_ranges; i++) {
+        numa_range_t *range = &numa.ranges[i];
+        if (pfn >= range->base_pfn && pfn < range->end_pfn) return range->node;
+    }
+    return 0;
+}
+
+// Returns the end of the run starting at pfn that stays on one node
+static uintptr_t numa_split(uintptr_t pfn, uintptr_t end_pfn, int *node) {
+    *node = numa_node_of_pfn(pfn);
+    for (int i = 0; i < numa.n_ranges; i++) {
+        numa_range_t *range = &numa.ranges[i];
+        if (pfn >= range->base_pfn && pfn < range->end_pfn) {
+            end_pfn = MIN(end_pfn, range->end_pfn);
+        } else if (range->base_pfn > pfn) {
+            end_pfn = MIN(end_pfn, range->base_pfn);
+        }
+    }
+    return end_pfn;
+}
+
+static int numa_node_of_domain(uint32_t domain) {
+    for (int i = 0; i < numa.n_nodes; i++) {
+        if (numa.domains[i] == domain) return i;
+    }
+    if (numa.n_nodes < MAX_NODES) {
+        numa.domains[numa.n_nodes] = domain;
+        return numa.n_nodes++;
+    }
+    return MAX_NODES - 1;
+}
+
+static void numa_reset() {
+    memset(&numa, 0, sizeof(numa));
+    numa.n_nodes = 1;
+}
+
+static void numa_init() {
+    numa_reset();
+    acpi_srat_t *srat = acpi_find_table(ACPI_SRAT_SIGNATURE);
+    if (!srat) return;
+
+    numa.n_nodes = 0;
+    size_t max_length = srat->Header.length - sizeof(acpi_srat_t);
+    for (size_t loc = 0; loc < max_length; ) {
+        uint8_t *p = srat->Structure + loc;
+        if (p[1] == 0) break;
+        switch (p[0]) {
+            case ACPI_SRAT_LAPIC:
+            {
+                acpi_srat_lapic_t *lapic = (void *)p;
+                if (lapic->flags & ACPI_SRAT_ENABLED) {
+                    uint32_t domain = lapic->proximity_domain_lo
+                        | (lapic->proximity_domain_hi[0] << 8)
+                        | (lapic->proximity_domain_hi[1] << 16)
+                        | (lapic->proximity_domain_hi[2] << 24);
+                    numa.apic_node[lapic->apic_id] = numa_node_of_domain(domain);
+                }
+            }
+                break;
+
+            case ACPI_SRAT_MEMORY:
+            {
+                acpi_srat_memory_t *mem = (void *)p;
+                if ((mem->flags & ACPI_SRAT_ENABLED) && mem->length_bytes && numa.n_ranges < MAX_NUMA_RANGES) {
+                    numa_range_t *range = &numa.ranges[numa.n_ranges++];
+                    range->base_pfn = mem->base_address >> PAGE_SHIFT;
+                    range->end_pfn = (mem->base_address + mem->length_bytes) >> PAGE_SHIFT;
+                    range->node = numa_node_of_domain(mem->proximity_domain);
+                }
+            }
+                break;
+
+            case ACPI_SRAT_X2APIC:
+            {
+                acpi_srat_x2apic_t *x2apic = (void *)p;
+                if ((x2apic->flags & ACPI_SRAT_ENABLED) && x2apic->x2apic_id < 256) {
+                    numa.apic_node[x2apic->x2apic_id] = numa_node_of_domain(x2apic->proximity_domain);
+                }
+            }
+                break;
+        }
+        loc += p[1];
+    }
+    if (numa.n_nodes == 0) {
+        numa_reset();
+        return;
+    }
+
+    acpi_slit_t *slit = acpi_find_table(ACPI_SLIT_SIGNATURE);
+    for (int i = 0; i < numa.n_nodes; i++) {
+        for (int j = 0; j < numa.n_nodes; j++) {
+            uint32_t from = numa.domains[i], to = numa.domains[j];
+            if (slit && from < slit->n_localities && to < slit->n_localities) {
+                numa.distance[i][j] = slit->entry[from * slit->n_localities + to];
+            } else {
+                numa.distance[i][j] = (i == j) ? LOCAL_DISTANCE : REMOTE_DISTANCE;
+            }
+        }
+    }
+}
+
+static void numa_build_zonelists() {
+    for (int node = 0; node < numa.n_nodes; node++) {
+        // Nodes sorted by distance from this node; ties keep the lower index first
+        int order[MAX_NODES];
+        for (int i = 0; i < numa.n_nodes; i++) {
+            order[i] = i;
+        }
+        for (int i = 1; i < numa.n_nodes; i++) {
+            for (int j = i; j > 0; j--) {
+                int a = order[j - 1], b = order[j];
+                int da = (a == node) ? 0 : numa.distance[node][a];
+                int db = (b == node) ? 0 : numa.distance[node][b];
+                if (da <= db) break;
+                order[j - 1] = b;
+                order[j] = a;
+            }
+        }
+        int n = 0;
+        for (int i = 0; i < numa.n_nodes; i++) {
+            numa.zonelist[node][n++] = order[i] * MAX_ZONE_TYPES + ZONE_NORMAL;
+        }
+        for (int i = 0; i < numa.n_nodes; i++) {
+            numa.zonelist[node][n++] = order[i] * MAX_ZONE_TYPES + ZONE_DMA32;
+        }
+    }
+}
+
+static int numa_zonelist_size() {
+    return numa.n_nodes * MAX_ZONE_TYPES;
+}
+
+// Per-CPU magazines are bounded LIFO caches in front of the global allocators
+typedef struct {
+    uint32_t count;
+    void *objs[MAG_OBJECTS];
+} obj_magazine_t;
+
+typedef struct mm_cpu_t mm_cpu_t;
+struct mm_cpu_t {
+    mm_cpu_t *next;
+    int cpuid, node;
+    moe_spinlock_t page_lock;
+    uint32_t n_pages;
+    uintptr_t pages[MAG_PAGES];
+    uintptr_t page_hits, page_misses;
+    moe_spinlock_t obj_lock;
+    uintptr_t obj_hits, obj_misses;
+    obj_magazine_t mags[MAX_MAG_CACHES];
+} __attribute__((aligned(64)));
+
+static mm_cpu_t *cpu_list;
+static int mm_magazines_enabled = 1;
+
+// must be called with interrupts disabled
+static mm_cpu_t *mm_get_cpu() {
+    return mm_magazines_enabled ? moe_get_cpu_mm() : NULL;
+}
+
+
+static free_block_t *pfn_to_block(uintptr_t pfn) {
+    return MOE_PA2VA(pfn << PAGE_SHIFT);
+}
+
+static uintptr_t block_to_pfn(free_block_t *block) {
+    return ((uintptr_t)block - (uintptr_t)MOE_PA2VA(0)) >> PAGE_SHIFT;
+}
+
+static int order_for_pages(size_t n) {
+    int order = 0;
+    while (order < MAX_ORDER - 1 && ((size_t)1 << order) < n) {
+        order++;
+    }
+    return order;
+}
+
+static void list_insert(free_block_t *head, free_block_t *block) {
+    block->prev = head;
+    block->next = head->next;
+    head->next->prev = block;
+    head->next = block;
+}
+
+static void list_remove(free_block_t *block) {
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+}
+
+
+// Allocate a block of 2^order pages, splitting a larger one if necessary
+static uintptr_t buddy_alloc(mm_zone_t *zone, int order) {
+    if (order >= MAX_ORDER) return INVALID_PFN;
+
+    free_area_t *area = &zone->area[order];
+    uintptr_t pfn = INVALID_PFN;
+    moe_spinlock_acquire(&area->lock);
+    free_block_t *block = area->head.next;
+    if (block != &area->head) {
+        list_remove(block);
+        atomic_fetch_add(&area->count, -1);
+        pfn = block_to_pfn(block);
+        zone->pf[pfn - zone->base_pfn] = order;
+    }
+    moe_spinlock_release(&area->lock);
+    if (pfn != INVALID_PFN) return pfn;
+
+    pfn = buddy_alloc(zone, order + 1);
+    if (pfn == INVALID_PFN) return INVALID_PFN;
+
+    // Give the upper half back to this order
+    uintptr_t buddy = pfn + ((uintptr_t)1 << order);
+    moe_spinlock_acquire(&area->lock);
+    zone->pf[buddy - zone->base_pfn] = PF_FREE | order;
+    list_insert(&area->head, pfn_to_block(buddy));
+    atomic_fetch_add(&area->count, 1);
+    moe_spinlock_release(&area->lock);
+    zone->pf[pfn - zone->base_pfn] = order;
+
+    return pfn;
+}
+
+// Free a block of 2^order pages, merging with its buddy as long as possible
+static void buddy_free(mm_zone_t *zone, uintptr_t pfn, int order) {
+    for (; order < MAX_ORDER; order++) {
+        free_area_t *area = &zone->area[order];
+        uintptr_t size = (uintptr_t)1 << order;
+        uintptr_t buddy = pfn ^ size;
+        moe_spinlock_acquire(&area->lock);
+        moe_assert((zone->pf[pfn - zone->base_pfn] & PF_FREE) == 0, "DOUBLE FREE PAGE %012zx\n", pfn << PAGE_SHIFT);
+        if (order < MAX_ORDER - 1
+            && buddy >= zone->base_pfn && buddy + size <= zone->end_pfn
+            && zone->pf[buddy - zone->base_pfn] == (PF_FREE | order)) {
+            list_remove(pfn_to_block(buddy));
+            atomic_fetch_add(&area->count, -1);
+            zone->pf[buddy - zone->base_pfn] = 0;
+            moe_spinlock_release(&area->lock);
+            pfn &= ~size;
+        } else {
+            zone->pf[pfn - zone->base_pfn] = PF_FREE | order;
+            list_insert(&area->head, pfn_to_block(pfn));
+            atomic_fetch_add(&area->count, 1);
+            moe_spinlock_release(&area->lock);
+            return;
+        }
+    }
+}
+
+// Free an arbitrary run of pages as a sequence of naturally aligned blocks
+static void buddy_free_range(mm_zone_t *zone, uintptr_t pfn, uintptr_t count) {
+    while (count > 0) {
+        int order = 0;
+        while (order < MAX_ORDER - 1
+            && (pfn & ((uintptr_t)1 << order)) == 0
+            && ((uintptr_t)2 << order) <= count) {
+            order++;
+        }
+        buddy_free(zone, pfn, order);
+        pfn += (uintptr_t)1 << order;
+        count -= (uintptr_t)1 << order;
+    }
+}
+
+static void zone_init(mm_zone_t *zone, const char *name, uintptr_t base_pfn, uintptr_t end_pfn, uintptr_t pf_pa) {
+    zone->name = name;
+    zone->base_pfn = base_pfn;
+    zone->end_pfn = end_pfn;
+    if (end_pfn > base_pfn) {
+        zone->pf = MOE_PA2VA(pf_pa);
+        memset((void *)zone->pf, 0, end_pfn - base_pfn);
+    }
+
+    for (int i = 0; i < MAX_ORDER; i++) {
+        free_area_t *area = &zone->area[i];
+        area->lock = 0;
+        area->head.next = area->head.prev = &area->head;
+        area->count = 0;
+    }
+}
+
+// Hands a run of pages to every zone it overlaps; holes between runs are never marked free
+static uintptr_t mm_add_free_range(uintptr_t pfn, uintptr_t end_pfn, int reclaimed) {
+    uintptr_t added = 0;
+    pfn = MAX(pfn, LOW_MEMORY_PFN);
+    for (int i = 0; i < MAX_ZONES; i++) {
+        mm_zone_t *zone = &zones[i];
+        uintptr_t start = MAX(pfn, zone->base_pfn);
+        uintptr_t end = MIN(end_pfn, zone->end_pfn);
+        if (start >= end) continue;
+        buddy_free_range(zone, start, end - start);
+        atomic_fetch_add(&zone->free_pages, end - start);
+        zone->managed_pages += end - start;
+        if (reclaimed) {
+            zone->reclaimed_pages += end - start;
+        }
+        added += end - start;
+    }
+    return added;
+}
+
+
 uintptr_t moe_alloc_gates_memory() {
     for (uintptr_t i = 1; i < 160; i++) {
         if (atomic_bit_test_and_clear(gates_memory_bitmap, i)) {
@@ -54,48 +470,1296 @@ uintptr_t moe_alloc_gates_memory() {
     return 0;
 }
 
+// Moves up to MAG_PAGE_BATCH single pages from the buddy lists of one zone into the magazine
+static uint32_t page_magazine_refill_zone(mm_zone_t *zone, mm_cpu_t *cpu) {
+    free_area_t *area = &zone->area[0];
+    uint32_t count = 0;
+    moe_spinlock_acquire(&area->lock);
+    while (count < MAG_PAGE_BATCH && area->head.next != &area->head) {
+        free_block_t *block = area->head.next;
+        list_remove(block);
+        atomic_fetch_add(&area->count, -1);
+        uintptr_t pfn = block_to_pfn(block);
+        zone->pf[pfn - zone->base_pfn] = 0;
+        cpu->pages[cpu->n_pages++] = pfn;
+        count++;
+    }
+    moe_spinlock_release(&area->lock);
+
+    if (count == 0) {
+        // Take a whole block at once rather than splitting it page by page
+        uintptr_t pfn = buddy_alloc(zone, MAG_BATCH_ORDER);
+        if (pfn != INVALID_PFN) {
+            for (count = (uint32_t)1 << MAG_BATCH_ORDER; count > 0; count--) {
+                uintptr_t page = pfn + count - 1;
+                zone->pf[page - zone->base_pfn] = 0;
+                cpu->pages[cpu->n_pages++] = page;
+            }
+            count = (uint32_t)1 << MAG_BATCH_ORDER;
+        } else if ((pfn = buddy_alloc(zone, 0)) != INVALID_PFN) {
+            cpu->pages[cpu->n_pages++] = pfn;
+            count = 1;
+        }
+    }
+    if (count) {
+        atomic_fetch_add(&zone->free_pages, -(uintptr_t)count);
+        atomic_fetch_add(&zone->n_alloc, 1);
+    }
+    return count;
+}
+
+static void page_magazine_refill(mm_cpu_t *cpu) {
+    for (int i = 0; i < numa_zonelist_size(); i++) {
+        mm_zone_t *zone = &zones[numa.zonelist[cpu->node][i]];
+        if (zone->free_pages && page_magazine_refill_zone(zone, cpu)) return;
+    }
+}
+
+static void page_magazine_drain(mm_cpu_t *cpu, uint32_t count) {
+    count = MIN(count, cpu->n_pages);
+    for (uint32_t i = 0; i < count; i++) {
+        uintptr_t pfn = cpu->pages[--cpu->n_pages];
+        mm_zone_t *zone = zone_of_pfn(pfn);
+        buddy_free(zone, pfn, 0);
+        atomic_fetch_add(&zone->free_pages, 1);
+    }
+}
+
+static uintptr_t page_magazine_alloc(mm_cpu_t *cpu) {
+    uintptr_t pfn = INVALID_PFN;
+    moe_spinlock_acquire(&cpu->page_lock);
+    if (cpu->n_pages == 0) {
+        page_magazine_refill(cpu);
+        cpu->page_misses++;
+    } else {
+        cpu->page_hits++;
+    }
+    if (cpu->n_pages) {
+        pfn = cpu->pages[--cpu->n_pages];
+    }
+    moe_spinlock_release(&cpu->page_lock);
+    return pfn;
+}
+
+static void page_magazine_free(mm_cpu_t *cpu, uintptr_t pfn) {
+    moe_spinlock_acquire(&cpu->page_lock);
+    if (cpu->n_pages == MAG_PAGES) {
+        page_magazine_drain(cpu, MAG_PAGE_BATCH);
+    }
+    cpu->pages[cpu->n_pages++] = pfn;
+    moe_spinlock_release(&cpu->page_lock);
+}
+
+// Returns every page cached in the magazines to the buddy lists
+static void mm_drain_pages() {
+    for (mm_cpu_t *cpu = cpu_list; cpu; cpu = cpu->next) {
+        uintptr_t flags = moe_spinlock_acquire_irq(&cpu->page_lock);
+        page_magazine_drain(cpu, MAG_PAGES);
+        moe_spinlock_release_irq(&cpu->page_lock, flags);
+    }
+}
+
+
+static uintptr_t zone_alloc(mm_zone_t *zone, uintptr_t count, int order) {
+    if (zone->free_pages < count) return INVALID_PFN;
+    uintptr_t pfn = buddy_alloc(zone, order);
+    if (pfn != INVALID_PFN) {
+        uintptr_t excess = ((uintptr_t)1 << order) - count;
+        if (excess) {
+            buddy_free_range(zone, pfn + count, excess);
+        }
+        atomic_fetch_add(&zone->free_pages, -count);
+        atomic_fetch_add(&zone->n_alloc, 1);
+    }
+    return pfn;
+}
+
+static uintptr_t zero_pool_take(mm_zone_t *zone) {
+    zero_pool_t *pool = &zone->zero_pool;
+    uintptr_t pfn = INVALID_PFN;
+    if (!pool->count) return pfn;
+    moe_spinlock_acquire(&pool->lock);
+    if (pool->count) {
+        pfn = pool->pfns[--pool->count];
+    }
+    moe_spinlock_release(&pool->lock);
+    return pfn;
+}
+
+// Non-temporal stores keep the zeroed page from evicting the caller's working set
+static void zero_page_nt(void *page) {
+    uintptr_t *p = page;
+    for (uintptr_t i = 0; i < PAGE_SIZE / sizeof(uintptr_t); i += 4) {
+        __asm__ volatile (
+            "movnti %1, 0(%0)\n"
+            "movnti %1, 8(%0)\n"
+            "movnti %1, 16(%0)\n"
+            "movnti %1, 24(%0)\n"
+            :: "r"(p + i), "r"((uintptr_t)0) : "memory");
+    }
+}
+
+uintptr_t mm_alloc_pages_node(size_t n, unsigned flags, int node) {
+    uintptr_t count = MAX(ceil_pagesize(n) >> PAGE_SHIFT, 1);
+    int order = order_for_pages(count);
+    if (count > ((uintptr_t)1 << order)) return 0;
+
+    uintptr_t pfn = INVALID_PFN;
+    int zeroed = 0;
+    uintptr_t irq = io_lock_irq();
+    mm_cpu_t *cpu = mm_get_cpu();
+    if (node < 0 || node >= numa.n_nodes) {
+        node = cpu ? cpu->node : 0;
+    }
+    const uint8_t *zonelist = numa.zonelist[node];
+    int n_zones = numa_zonelist_size();
+    // DMA32 requests skip the magazines, which may hold pages from any zone
+    int use_magazine = (count == 1 && cpu && cpu->node == node && !(flags & MM_ZONE_DMA32));
+    int type_mask = (flags & MM_ZONE_DMA32) ? (1 << ZONE_DMA32) : (1 << ZONE_DMA32) | (1 << ZONE_NORMAL);
+
+    if (count == 1 && (flags & MM_ZERO)) {
+        for (int i = 0; i < n_zones && pfn == INVALID_PFN; i++) {
+            if (type_mask & (1 << (zonelist[i] % MAX_ZONE_TYPES))) {
+                pfn = zero_pool_take(&zones[zonelist[i]]);
+            }
+        }
+        zeroed = (pfn != INVALID_PFN);
+    }
+    if (pfn == INVALID_PFN && use_magazine) {
+        pfn = page_magazine_alloc(cpu);
+    }
+    for (int i = 0; !use_magazine && i < n_zones && pfn == INVALID_PFN; i++) {
+        if (type_mask & (1 << (zonelist[i] % MAX_ZONE_TYPES))) {
+            pfn = zone_alloc(&zones[zonelist[i]], count, order);
+        }
+    }
+    // The zero pool is also a last resort when the buddy lists run dry
+    for (int i = 0; count == 1 && i < n_zones && pfn == INVALID_PFN; i++) {
+        if (type_mask & (1 << (zonelist[i] % MAX_ZONE_TYPES))) {
+            pfn = zero_pool_take(&zones[zonelist[i]]);
+        }
+    }
+    io_restore_irq(irq);
+
+    if (pfn == INVALID_PFN) return 0;
+    if (flags & MM_ZERO) {
+        zero_pool_t *pool = &zone_of_pfn(pfn)->zero_pool;
+        if (zeroed) {
+            atomic_fetch_add(&pool->hits, 1);
+        } else {
+            atomic_fetch_add(&pool->misses, 1);
+            memset(MOE_PA2VA(pfn << PAGE_SHIFT), 0, count << PAGE_SHIFT);
+        }
+    }
+    return pfn << PAGE_SHIFT;
+}
+
+// Allocates from the calling CPU's node first, then by distance
+uintptr_t mm_alloc_pages(size_t n, unsigned flags) {
+    return mm_alloc_pages_node(n, flags, -1);
+}
+
+int mm_get_number_of_nodes() {
+    return numa.n_nodes;
+}
+
+int mm_node_of_cpu(int cpuid) {
+    return numa.apic_node[smp_get_apicid(cpuid) & 0xFF];
+}
+
+int mm_node_of_pa(uintptr_t pa) {
+    return numa_node_of_pfn(pa >> PAGE_SHIFT);
+}
+
+// Refills the zero pools with up to ZERO_BATCH pages, returns the number of pages zeroed
+int mm_zero_pages() {
+    int zeroed = 0;
+    for (int i = 0; i < MAX_ZONES; i++) {
+        mm_zone_t *zone = &zones[i];
+        zero_pool_t *pool = &zone->zero_pool;
+        // Leave the last free pages to the buddy lists
+        while (zeroed < ZERO_BATCH && pool->count < ZERO_POOL_PAGES
+            && zone->free_pages > ZERO_POOL_PAGES * 2) {
+            uintptr_t flags = io_lock_irq();
+            uintptr_t pfn = zone_alloc(zone, 1, 0);
+            io_restore_irq(flags);
+            if (pfn == INVALID_PFN) break;
+
+            zero_page_nt(MOE_PA2VA(pfn << PAGE_SHIFT));
+            __asm__ volatile ("sfence" ::: "memory");
+
+            flags = io_lock_irq();
+            moe_spinlock_acquire(&pool->lock);
+            int stored = pool->count < ZERO_POOL_PAGES;
+            if (stored) {
+                pool->pfns[pool->count++] = pfn;
+            }
+            moe_spinlock_release(&pool->lock);
+            if (!stored) {
+                buddy_free(zone, pfn, 0);
+                atomic_fetch_add(&zone->free_pages, 1);
+            }
+            io_restore_irq(flags);
+            if (!stored) break;
+            atomic_fetch_add(&pool->zeroed, 1);
+            zeroed++;
+        }
+    }
+    return zeroed;
+}
+
 uintptr_t moe_alloc_physical_page(size_t n) {
-    uintptr_t size = ceil_pagesize(n);
-    uintptr_t free = atomic_load(&free_memory);
-    while (free > size) {
-        if (atomic_compare_exchange_strong(&free_memory, &free, free - size)) {
-            uintptr_t result = atomic_fetch_add(&static_start, size);
-            return result;
+    return mm_alloc_pages(n, 0);
+}
+
+void moe_free_physical_page(uintptr_t pa, size_t n) {
+    if (!pa) return;
+    uintptr_t pfn = pa >> PAGE_SHIFT;
+    uintptr_t count = MAX(ceil_pagesize(n) >> PAGE_SHIFT, 1);
+    mm_zone_t *zone = zone_of_pfn(pfn);
+    moe_assert(zone && pfn + count <= zone->end_pfn, "BAD PAGE %012zx\n", pa);
+
+    uintptr_t flags = io_lock_irq();
+    if (count == 1) {
+        mm_cpu_t *cpu = mm_get_cpu();
+        if (cpu) {
+            page_magazine_free(cpu, pfn);
+            io_restore_irq(flags);
+            return;
+        }
+    }
+    buddy_free_range(zone, pfn, count);
+    atomic_fetch_add(&zone->free_pages, count);
+    atomic_fetch_add(&zone->n_free, 1);
+    io_restore_irq(flags);
+}
+
+
+/*********************************************************************/
+// Slab Object Allocator
+
+typedef struct slab_link_t slab_link_t;
+struct slab_link_t {
+    slab_link_t *next, *prev;
+};
+
+typedef struct {
+    slab_link_t link;
+    moe_cache_t *cache;
+    void *free_list;
+    uint32_t inuse, color;
+} __attribute__((aligned(64))) moe_slab_t;
+
+struct moe_cache_t {
+    moe_cache_t *next;
+    char name[CACHE_NAME_SIZE];
+    size_t size, obj_size, link_offset;
+    // The first object starts at obj_offset plus a multiple of color_step, both multiples of the alignment
+    size_t obj_offset, color_step;
+    MOE_CACHE_CTOR ctor;
+    moe_spinlock_t lock;
+    slab_link_t partial, full, empty;
+    int slab_order, mag_index;
+    uint32_t objs_per_slab, color_next, color_max;
+    uintptr_t n_slabs, n_empty, n_inuse;
+};
+
+// What meminfo prints for a cache
+typedef struct {
+    char name[CACHE_NAME_SIZE];
+    size_t size, obj_size, inuse, total, slab_bytes;
+} cache_info_t;
+
+static moe_cache_t cache_cache;
+static moe_cache_t size_caches[N_SIZE_CLASSES];
+static moe_cache_t *cache_list;
+static moe_spinlock_t cache_list_lock;
+// Magazine slots in use, one bit for each of the MAX_MAG_CACHES slots
+static uint32_t mag_index_map;
+
+static _Atomic uintptr_t large_requested, large_allocated, large_count;
+
+
+static void slab_list_init(slab_link_t *head) {
+    head->next = head->prev = head;
+}
+
+static void slab_list_insert(slab_link_t *head, slab_link_t *link) {
+    link->prev = head;
+    link->next = head->next;
+    head->next->prev = link;
+    head->next = link;
+}
+
+static void slab_list_remove(slab_link_t *link) {
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+}
+
+static void **obj_link(moe_cache_t *cache, void *obj) {
+    return (void **)((uintptr_t)obj + cache->link_offset);
+}
+
+static void slab_set_page_flags(uintptr_t pa, int order, uint8_t flags) {
+    uintptr_t pfn = pa >> PAGE_SHIFT;
+    mm_zone_t *zone = zone_of_pfn(pfn);
+    for (uintptr_t i = 0; i < ((uintptr_t)1 << order); i++) {
+        zone->pf[pfn + i - zone->base_pfn] = flags;
+    }
+}
+
+static moe_slab_t *slab_of(void *obj) {
+    uintptr_t pfn = ((uintptr_t)obj - (uintptr_t)MOE_PA2VA(0)) >> PAGE_SHIFT;
+    mm_zone_t *zone = zone_of_pfn(pfn);
+    if (!zone) return NULL;
+    uint8_t pf = zone->pf[pfn - zone->base_pfn];
+    if ((pf & (PF_SLAB | PF_FREE)) != PF_SLAB) return NULL;
+    uintptr_t mask = ((uintptr_t)PAGE_SIZE << (pf & PF_ORDER_MASK)) - 1;
+    return (moe_slab_t *)((uintptr_t)obj & ~mask);
+}
+
+static moe_slab_t *slab_create(moe_cache_t *cache, uint32_t color) {
+    size_t slab_size = (size_t)PAGE_SIZE << cache->slab_order;
+    uintptr_t pa = moe_alloc_physical_page(slab_size);
+    if (!pa) return NULL;
+    slab_set_page_flags(pa, cache->slab_order, PF_SLAB | cache->slab_order);
+
+    moe_slab_t *slab = MOE_PA2VA(pa);
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->color = color;
+    slab->free_list = NULL;
+
+    // Coloring shifts the first object so that slabs do not all start on the same cache sets
+    uintptr_t base = (uintptr_t)slab + cache->obj_offset + color * cache->color_step;
+    for (uint32_t i = cache->objs_per_slab; i > 0; i--) {
+        void *obj = (void *)(base + (i - 1) * cache->obj_size);
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+        *obj_link(cache, obj) = slab->free_list;
+        slab->free_list = obj;
+    }
+    return slab;
+}
+
+static void slab_destroy(moe_cache_t *cache, moe_slab_t *slab) {
+    uintptr_t pa = (uintptr_t)slab - (uintptr_t)MOE_PA2VA(0);
+    slab_set_page_flags(pa, cache->slab_order, 0);
+    moe_free_physical_page(pa, (size_t)PAGE_SIZE << cache->slab_order);
+}
+
+static void cache_init(moe_cache_t *cache, const char *name, size_t size, size_t align, MOE_CACHE_CTOR ctor) {
+    memset(cache, 0, sizeof(moe_cache_t));
+    strncpy(cache->name, name, CACHE_NAME_SIZE);
+    cache->size = size;
+    cache->ctor = ctor;
+
+    align = MAX(align, SLAB_MIN_ALIGN);
+    if (size >= CACHE_LINE_SIZE) {
+        align = MAX(align, CACHE_LINE_SIZE);
+    }
+    // Slabs are page aligned, so objects can be aligned up to a page
+    moe_assert((align & (align - 1)) == 0 && align <= PAGE_SIZE, "BAD ALIGNMENT FOR CACHE %s\n", name);
+    cache->obj_offset = (sizeof(moe_slab_t) + align - 1) & ~(align - 1);
+    cache->color_step = MAX(align, CACHE_LINE_SIZE);
+    // Constructed objects keep their state while free, so the link goes after the object
+    size_t raw_size = MAX(size, sizeof(void *));
+    if (ctor) {
+        cache->link_offset = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+        raw_size = cache->link_offset + sizeof(void *);
+    }
+    cache->obj_size = (raw_size + align - 1) & ~(align - 1);
+
+    // Pick the smallest slab wasting no more than 1/8 of its size
+    size_t slab_size = 0, objs = 0;
+    for (int order = 0; order <= MAX_SLAB_ORDER; order++) {
+        slab_size = (size_t)PAGE_SIZE << order;
+        objs = (slab_size - cache->obj_offset) / cache->obj_size;
+        cache->slab_order = order;
+        if (objs && (slab_size - cache->obj_offset - objs * cache->obj_size) <= slab_size / 8) break;
+    }
+    moe_assert(objs, "OBJECT TOO LARGE FOR CACHE %s\n", name);
+    cache->objs_per_slab = objs;
+    cache->color_max = (slab_size - cache->obj_offset - objs * cache->obj_size) / cache->color_step;
+
+    slab_list_init(&cache->partial);
+    slab_list_init(&cache->full);
+    slab_list_init(&cache->empty);
+
+    moe_spinlock_acquire(&cache_list_lock);
+    uint32_t free_slots = ~mag_index_map;
+    if (free_slots) {
+        cache->mag_index = __builtin_ctz(free_slots);
+        mag_index_map |= UINT32_C(1) << cache->mag_index;
+    } else {
+        cache->mag_index = -1;
+    }
+    cache->next = cache_list;
+    cache_list = cache;
+    moe_spinlock_release(&cache_list_lock);
+}
+
+moe_cache_t *moe_cache_create(const char *name, size_t size, size_t align, MOE_CACHE_CTOR ctor) {
+    moe_cache_t *cache = moe_cache_alloc(&cache_cache);
+    if (cache) {
+        cache_init(cache, name, size, align, ctor);
+    }
+    return cache;
+}
+
+// Pops up to n objects from the slabs of the cache
+static int cache_refill(moe_cache_t *cache, void **objs, int n) {
+    int count = 0;
+    moe_spinlock_acquire(&cache->lock);
+    while (count < n) {
+        slab_link_t *link = cache->partial.next;
+        if (link == &cache->partial) {
+            link = cache->empty.next;
+            if (link != &cache->empty) {
+                cache->n_empty--;
+            } else {
+                uint32_t color = cache->color_next;
+                cache->color_next = (color < cache->color_max) ? color + 1 : 0;
+                moe_spinlock_release(&cache->lock);
+                moe_slab_t *slab = slab_create(cache, color);
+                moe_spinlock_acquire(&cache->lock);
+                if (!slab) break;
+                cache->n_slabs++;
+                link = &slab->link;
+                slab_list_insert(&cache->empty, link);
+            }
+            slab_list_remove(link);
+            slab_list_insert(&cache->partial, link);
+        }
+
+        moe_slab_t *slab = (moe_slab_t *)link;
+        while (count < n && slab->free_list) {
+            void *obj = slab->free_list;
+            slab->free_list = *obj_link(cache, obj);
+            slab->inuse++;
+            cache->n_inuse++;
+            objs[count++] = obj;
+        }
+        if (slab->inuse == cache->objs_per_slab) {
+            slab_list_remove(link);
+            slab_list_insert(&cache->full, link);
+        }
+    }
+    moe_spinlock_release(&cache->lock);
+    return count;
+}
+
+// Returns n objects to their slabs and releases slabs beyond MAX_EMPTY_SLABS
+static void cache_release(moe_cache_t *cache, void **objs, int n) {
+    slab_link_t release;
+    slab_list_init(&release);
+
+    moe_spinlock_acquire(&cache->lock);
+    for (int i = 0; i < n; i++) {
+        void *obj = objs[i];
+        moe_slab_t *slab = slab_of(obj);
+        *obj_link(cache, obj) = slab->free_list;
+        slab->free_list = obj;
+        if (slab->inuse-- == cache->objs_per_slab) {
+            slab_list_remove(&slab->link);
+            slab_list_insert(&cache->partial, &slab->link);
+        }
+        cache->n_inuse--;
+        if (slab->inuse == 0) {
+            slab_list_remove(&slab->link);
+            if (cache->n_empty < MAX_EMPTY_SLABS) {
+                slab_list_insert(&cache->empty, &slab->link);
+                cache->n_empty++;
+            } else {
+                cache->n_slabs--;
+                slab_list_insert(&release, &slab->link);
+            }
+        }
+    }
+    moe_spinlock_release(&cache->lock);
+
+    while (release.next != &release) {
+        moe_slab_t *slab = (moe_slab_t *)release.next;
+        slab_list_remove(&slab->link);
+        slab_destroy(cache, slab);
+    }
+}
+
+// Returns the objects cached for this cache in every magazine
+static void cache_drain_magazines(moe_cache_t *cache) {
+    if (cache->mag_index < 0) return;
+    for (mm_cpu_t *cpu = cpu_list; cpu; cpu = cpu->next) {
+        uintptr_t flags = moe_spinlock_acquire_irq(&cpu->obj_lock);
+        obj_magazine_t *mag = &cpu->mags[cache->mag_index];
+        cache_release(cache, mag->objs, mag->count);
+        mag->count = 0;
+        moe_spinlock_release_irq(&cpu->obj_lock, flags);
+    }
+}
+
+void moe_cache_destroy(moe_cache_t *cache) {
+    if (!cache) return;
+    cache_drain_magazines(cache);
+    moe_assert(cache->n_inuse == 0, "CACHE %s STILL IN USE\n", cache->name);
+
+    moe_spinlock_acquire(&cache_list_lock);
+    for (moe_cache_t **p = &cache_list; *p; p = &(*p)->next) {
+        if (*p == cache) {
+            *p = cache->next;
+            break;
+        }
+    }
+    // Its magazines were drained above, so the slot can go to the next cache
+    if (cache->mag_index >= 0) {
+        mag_index_map &= ~(UINT32_C(1) << cache->mag_index);
+    }
+    moe_spinlock_release(&cache_list_lock);
+
+    while (cache->empty.next != &cache->empty) {
+        moe_slab_t *slab = (moe_slab_t *)cache->empty.next;
+        slab_list_remove(&slab->link);
+        slab_destroy(cache, slab);
+    }
+    moe_cache_free(&cache_cache, cache);
+}
+
+void *moe_cache_alloc(moe_cache_t *cache) {
+    void *obj = NULL;
+    uintptr_t flags = io_lock_irq();
+    mm_cpu_t *cpu = (cache->mag_index >= 0) ? mm_get_cpu() : NULL;
+    if (cpu) {
+        obj_magazine_t *mag = &cpu->mags[cache->mag_index];
+        moe_spinlock_acquire(&cpu->obj_lock);
+        if (mag->count == 0) {
+            mag->count = cache_refill(cache, mag->objs, MAG_OBJECT_BATCH);
+            cpu->obj_misses++;
         } else {
-            cpu_relax();
+            cpu->obj_hits++;
+        }
+        if (mag->count) {
+            obj = mag->objs[--mag->count];
         }
+        moe_spinlock_release(&cpu->obj_lock);
+    } else {
+        cache_refill(cache, &obj, 1);
     }
-    return 0;
+    io_restore_irq(flags);
+
+    if (obj && !cache->ctor) {
+        memset(obj, 0, cache->size);
+    }
+    return obj;
 }
 
-void *moe_alloc_object(size_t size, size_t count) {
-    size_t sz = ceil_pagesize(size * count);
+void moe_cache_free(moe_cache_t *cache, void *obj) {
+    if (!obj) return;
+    moe_slab_t *slab = slab_of(obj);
+    moe_assert(slab && slab->cache == cache, "BAD OBJECT %p FOR CACHE %s\n", obj, cache->name);
+
+    uintptr_t flags = io_lock_irq();
+    mm_cpu_t *cpu = (cache->mag_index >= 0) ? mm_get_cpu() : NULL;
+    if (cpu) {
+        obj_magazine_t *mag = &cpu->mags[cache->mag_index];
+        moe_spinlock_acquire(&cpu->obj_lock);
+        if (mag->count == MAG_OBJECTS) {
+            mag->count -= MAG_OBJECT_BATCH;
+            cache_release(cache, &mag->objs[mag->count], MAG_OBJECT_BATCH);
+        }
+        mag->objs[mag->count++] = obj;
+        moe_spinlock_release(&cpu->obj_lock);
+    } else {
+        cache_release(cache, &obj, 1);
+    }
+    io_restore_irq(flags);
+}
+
+
+// Buddy blocks are naturally aligned, so objects of 2MB or more start on a 2MB
+// boundary and pg_valloc maps them with large pages
+static void *alloc_large_object(size_t size, unsigned flags) {
+    size_t sz = ceil_pagesize(size);
     void *va = NULL;
-    uintptr_t pa = moe_alloc_physical_page(sz);
+    uintptr_t pa = mm_alloc_pages(sz, flags);
     if (pa) {
         va = pg_valloc(pa, sz);
-        memset(va, 0, sz);
+        atomic_fetch_add(&large_requested, size);
+        atomic_fetch_add(&large_allocated, sz);
+        atomic_fetch_add(&large_count, 1);
     }
     return va;
 }
 
+static void free_large_object(void *va) {
+    uintptr_t pa = pg_va2pa(va);
+    size_t sz = pg_vfree(va);
+    if (sz) {
+        moe_free_physical_page(pa, sz);
+        atomic_fetch_add(&large_allocated, -sz);
+        atomic_fetch_add(&large_count, -1);
+    }
+}
+
+static moe_cache_t *size_class_of(size_t size) {
+    size_t class_size = MIN_SIZE_CLASS;
+    for (int i = 0; i < N_SIZE_CLASSES; i++, class_size <<= 1) {
+        if (size <= class_size) {
+            return &size_caches[i];
+        }
+    }
+    return NULL;
+}
+
+void *moe_alloc_object(size_t size, size_t count) {
+    size_t sz = size * count;
+    moe_cache_t *cache = size_class_of(sz);
+    if (cache) {
+        return moe_cache_alloc(cache);
+    } else {
+        return alloc_large_object(sz, MM_ZERO);
+    }
+}
 
+void moe_free_object(void *ptr) {
+    if (!ptr) return;
+    moe_slab_t *slab = slab_of(ptr);
+    if (slab) {
+        moe_cache_free(slab->cache, ptr);
+    } else {
+        free_large_object(ptr);
+    }
+}
+
+// Returns every object and page cached in the magazines to the global pools
+static void mm_drain_all() {
+    moe_spinlock_acquire(&cache_list_lock);
+    for (moe_cache_t *cache = cache_list; cache; cache = cache->next) {
+        cache_drain_magazines(cache);
+    }
+    moe_spinlock_release(&cache_list_lock);
+    mm_drain_pages();
+}
+
+void *mm_init_cpu(int cpuid) {
+    mm_cpu_t *cpu = moe_alloc_object(sizeof(mm_cpu_t), 1);
+    if (cpu) {
+        cpu->cpuid = cpuid;
+        cpu->node = mm_node_of_cpu(cpuid);
+        moe_spinlock_acquire(&cache_list_lock);
+        cpu->next = cpu_list;
+        cpu_list = cpu;
+        moe_spinlock_release(&cache_list_lock);
+    }
+    return cpu;
+}
+
+static void slab_init() {
+    cache_init(&cache_cache, "moe_cache", sizeof(moe_cache_t), 0, NULL);
+    size_t class_size = MIN_SIZE_CLASS;
+    for (int i = 0; i < N_SIZE_CLASSES; i++, class_size <<= 1) {
+        char name[CACHE_NAME_SIZE];
+        snprintf(name, CACHE_NAME_SIZE, "size-%zu", class_size);
+        cache_init(&size_caches[i], name, class_size, class_size, NULL);
+    }
+}
+
+
+// I/O buffers stay below 4GB for devices without 64bit addressing
 uintptr_t moe_alloc_io_buffer(size_t size) {
     size_t sz = ceil_pagesize(size);
-    uintptr_t pa = moe_alloc_physical_page(sz);
-    if (pa) {
-        void *va = MOE_PA2VA(pa);
-        memset(va, 0, sz);
+    return mm_alloc_pages(sz, MM_ZONE_DMA32 | MM_ZERO);
+}
+
+
+/*********************************************************************/
+// DMA Pool
+
+// Chunks come from the DMA32 zone and are never returned until the pool is destroyed
+typedef struct dma_chunk_t dma_chunk_t;
+struct dma_chunk_t {
+    dma_chunk_t *next;
+    uintptr_t pa;
+};
+
+struct moe_dma_pool_t {
+    moe_dma_pool_t *next;
+    moe_spinlock_t lock;
+    char name[CACHE_NAME_SIZE];
+    size_t size, stride, boundary, chunk_size;
+    void *free_list;
+    dma_chunk_t *chunks;
+    uintptr_t n_chunks, n_objects, n_inuse;
+};
+
+static moe_dma_pool_t *dma_pool_list;
+static moe_spinlock_t dma_pool_list_lock;
+
+static int is_pow2(size_t n) {
+    return n && (n & (n - 1)) == 0;
+}
+
+moe_dma_pool_t *moe_dma_pool_create(const char *name, size_t size, size_t align, size_t boundary) {
+    align = MAX(align, sizeof(void *));
+    size = MAX(size, sizeof(void *));
+    if (!is_pow2(align)) return NULL;
+    if (boundary && (!is_pow2(boundary) || boundary < size || boundary < align)) return NULL;
+
+    moe_dma_pool_t *pool = moe_alloc_object(sizeof(moe_dma_pool_t), 1);
+    if (!pool) return NULL;
+    strncpy(pool->name, name, CACHE_NAME_SIZE - 1);
+    pool->size = size;
+    pool->stride = (size + align - 1) & ~(align - 1);
+    pool->boundary = boundary;
+    // Buddy blocks are aligned to their own size, which covers alignments above a page
+    pool->chunk_size = MAX(ceil_pagesize(pool->stride), MAX(align, PAGE_SIZE));
+
+    uintptr_t flags = moe_spinlock_acquire_irq(&dma_pool_list_lock);
+    pool->next = dma_pool_list;
+    dma_pool_list = pool;
+    moe_spinlock_release_irq(&dma_pool_list_lock, flags);
+    return pool;
+}
+
+void moe_dma_pool_destroy(moe_dma_pool_t *pool) {
+    if (!pool) return;
+    uintptr_t flags = moe_spinlock_acquire_irq(&dma_pool_list_lock);
+    for (moe_dma_pool_t **p = &dma_pool_list; *p; p = &(*p)->next) {
+        if (*p == pool) {
+            *p = pool->next;
+            break;
+        }
+    }
+    moe_spinlock_release_irq(&dma_pool_list_lock, flags);
+
+    dma_chunk_t *chunk = pool->chunks;
+    while (chunk) {
+        dma_chunk_t *next = chunk->next;
+        moe_free_physical_page(chunk->pa, pool->chunk_size);
+        moe_free_object(chunk);
+        chunk = next;
+    }
+    moe_free_object(pool);
+}
+
+// Carves a new chunk into objects, skipping positions that would cross the boundary
+static int dma_pool_grow(moe_dma_pool_t *pool) {
+    dma_chunk_t *chunk = moe_alloc_object(sizeof(dma_chunk_t), 1);
+    if (!chunk) return 0;
+    chunk->pa = mm_alloc_pages(pool->chunk_size, MM_ZONE_DMA32);
+    if (!chunk->pa) {
+        moe_free_object(chunk);
+        return 0;
+    }
+
+    void *head = NULL;
+    uintptr_t count = 0;
+    uintptr_t end = chunk->pa + pool->chunk_size;
+    for (uintptr_t pa = chunk->pa; pa + pool->size <= end; pa += pool->stride) {
+        if (pool->boundary && ((pa ^ (pa + pool->size - 1)) & ~(pool->boundary - 1))) {
+            pa = (pa + pool->boundary - 1) & ~(pool->boundary - 1);
+            if (pa + pool->size > end) break;
+        }
+        void **obj = MOE_PA2VA(pa);
+        *obj = head;
+        head = obj;
+        count++;
+    }
+
+    uintptr_t flags = moe_spinlock_acquire_irq(&pool->lock);
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->n_chunks++;
+    pool->n_objects += count;
+    // The new objects are linked in reverse, so the lowest address is handed out first
+    while (head) {
+        void **obj = head;
+        head = *obj;
+        *obj = pool->free_list;
+        pool->free_list = obj;
+    }
+    moe_spinlock_release_irq(&pool->lock, flags);
+    return 1;
+}
+
+// Returns a zeroed object below 4GB, its physical address goes to pa
+void *moe_dma_pool_alloc(moe_dma_pool_t *pool, MOE_PHYSICAL_ADDRESS *pa) {
+    void *obj = NULL;
+    for (int retry = 0; !obj && retry < 2; retry++) {
+        uintptr_t flags = moe_spinlock_acquire_irq(&pool->lock);
+        obj = pool->free_list;
+        if (obj) {
+            pool->free_list = *(void **)obj;
+            pool->n_inuse++;
+        }
+        moe_spinlock_release_irq(&pool->lock, flags);
+        if (!obj && !dma_pool_grow(pool)) break;
     }
-    return pa;
+    if (obj) {
+        memset(obj, 0, pool->size);
+        if (pa) {
+            *pa = (uintptr_t)obj - (uintptr_t)MOE_PA2VA(0);
+        }
+    }
+    return obj;
+}
+
+void moe_dma_pool_free(moe_dma_pool_t *pool, void *va) {
+    if (!va) return;
+    uintptr_t flags = moe_spinlock_acquire_irq(&pool->lock);
+    *(void **)va = pool->free_list;
+    pool->free_list = va;
+    pool->n_inuse--;
+    moe_spinlock_release_irq(&pool->lock, flags);
 }
 
 
+static int is_boot_memory(uint32_t type) {
+    return type == EFI_LOADER_DATA || type == EFI_BOOT_SERVICES_CODE || type == EFI_BOOT_SERVICES_DATA;
+}
+
+static void span_add(uintptr_t *zone_base, uintptr_t *zone_end, int index, uintptr_t pfn, uintptr_t end_pfn) {
+    zone_base[index] = MIN(zone_base[index], pfn);
+    zone_end[index] = MAX(zone_end[index], end_pfn);
+}
+
+// Returns 0 if the zone spans of different nodes overlap
+static int mm_compute_spans(uintptr_t mmap, uintptr_t n_desc, uintptr_t desc_size, uintptr_t *zone_base, uintptr_t *zone_end) {
+    for (int i = 0; i < MAX_ZONES; i++) {
+        zone_base[i] = UINTPTR_MAX;
+        zone_end[i] = 0;
+    }
+    for (uintptr_t i = 0; i < n_desc; i++) {
+        efi_memory_descriptor_t *desc = (void *)(mmap + i * desc_size);
+        if (desc->type != EFI_CONVENTIONAL_MEMORY && !is_boot_memory(desc->type)) continue;
+        uintptr_t pfn = MAX(desc->physical_start >> PAGE_SHIFT, LOW_MEMORY_PFN);
+        uintptr_t end_pfn = (desc->physical_start >> PAGE_SHIFT) + desc->n_pages;
+        while (pfn < end_pfn) {
+            int node;
+            uintptr_t piece_end = numa_split(pfn, end_pfn, &node);
+            uintptr_t dma_end = MIN(piece_end, DMA32_LIMIT_PFN);
+            if (pfn < dma_end) {
+                span_add(zone_base, zone_end, node * MAX_ZONE_TYPES + ZONE_DMA32, pfn, dma_end);
+            }
+            uintptr_t normal_base = MAX(pfn, DMA32_LIMIT_PFN);
+            if (normal_base < piece_end) {
+                span_add(zone_base, zone_end, node * MAX_ZONE_TYPES + ZONE_NORMAL, normal_base, piece_end);
+            }
+            pfn = piece_end;
+        }
+    }
+    for (int i = 0; i < MAX_ZONES; i++) {
+        for (int j = i + 1; j < MAX_ZONES; j++) {
+            if (zone_base[i] < zone_end[j] && zone_base[j] < zone_end[i]) return 0;
+        }
+    }
+    return 1;
+}
+
 void mm_init(moe_bootinfo_t *bootinfo) {
-    static_start = bootinfo->static_start;
-    free_memory = bootinfo->free_memory;
     total_memory = bootinfo->total_memory;
-    // memset32((void*)static_start, 0xdeadbeef, free_memory / 4);
-
     memcpy(gates_memory_bitmap, bootinfo->gates_memory_bitmap, sizeof(gates_memory_bitmap));
+
+    // The boot loader carved its page tables and the kernel image from the head of this run
+    uintptr_t static_pfn = ceil_pagesize(bootinfo->static_start) >> PAGE_SHIFT;
+    uintptr_t static_end_pfn = (bootinfo->static_start + bootinfo->free_memory) >> PAGE_SHIFT;
+
+    efi_memory_descriptor_t fallback = { EFI_CONVENTIONAL_MEMORY, 0,
+        bootinfo->static_start, 0, bootinfo->free_memory >> PAGE_SHIFT, 0 };
+    uintptr_t mmap = (uintptr_t)&fallback;
+    uintptr_t n_desc = 1, desc_size = sizeof(fallback);
+    if (bootinfo->mmdescsz) {
+        mmap = (uintptr_t)MOE_PA2VA(bootinfo->mmbase);
+        desc_size = bootinfo->mmdescsz;
+        n_desc = bootinfo->mmsize / desc_size;
+    }
+
+    // Zone spans cover every run the allocator may ever own, including reclaimable ones
+    numa_init();
+    uintptr_t zone_base[MAX_ZONES], zone_end[MAX_ZONES];
+    while (!mm_compute_spans(mmap, n_desc, desc_size, zone_base, zone_end)) {
+        // The buddy zones cannot interleave, so fall back to a single node
+        numa_reset();
+    }
+    numa_build_zonelists();
+    for (uintptr_t i = 0; i < n_desc; i++) {
+        efi_memory_descriptor_t *desc = (void *)(mmap + i * desc_size);
+        if (is_boot_memory(desc->type)) {
+            n_boot_ranges++;
+        }
+    }
+
+    // The page state tables come from the boot allocator's run as well
+    static const char *zone_names[MAX_ZONE_TYPES] = { "DMA32", "Normal" };
+    for (int i = 0; i < MAX_ZONES; i++) {
+        const char *name = zone_names[i % MAX_ZONE_TYPES];
+        uintptr_t pf_pa = 0;
+        if (zone_base[i] < zone_end[i]) {
+            pf_pa = static_pfn << PAGE_SHIFT;
+            static_pfn += ceil_pagesize(zone_end[i] - zone_base[i]) >> PAGE_SHIFT;
+            moe_assert(static_pfn <= static_end_pfn, "NOT ENOUGH MEMORY FOR ZONE %s\n", name);
+        } else {
+            zone_base[i] = zone_end[i] = 0;
+        }
+        zone_init(&zones[i], name, zone_base[i], zone_end[i], pf_pa);
+        zones[i].node = i / MAX_ZONE_TYPES;
+    }
+
+    for (uintptr_t i = 0; i < n_desc; i++) {
+        efi_memory_descriptor_t *desc = (void *)(mmap + i * desc_size);
+        if (desc->type != EFI_CONVENTIONAL_MEMORY) continue;
+        uintptr_t pfn = desc->physical_start >> PAGE_SHIFT;
+        uintptr_t end_pfn = pfn + desc->n_pages;
+        if (pfn <= static_pfn && static_pfn < end_pfn) {
+            pfn = static_pfn;
+            end_pfn = MIN(end_pfn, static_end_pfn);
+        }
+        mm_add_free_range(pfn, end_pfn, 0);
+    }
+
+    slab_init();
+
+    // Boot services and loader data are released once the boot data in them has been consumed
+    if (n_boot_ranges) {
+        boot_ranges = moe_alloc_object(sizeof(mm_range_t), n_boot_ranges);
+        n_boot_ranges = 0;
+        for (uintptr_t i = 0; i < n_desc && boot_ranges; i++) {
+            efi_memory_descriptor_t *desc = (void *)(mmap + i * desc_size);
+            if (!is_boot_memory(desc->type)) continue;
+            mm_range_t *range = &boot_ranges[n_boot_ranges++];
+            range->pfn = desc->physical_start >> PAGE_SHIFT;
+            range->n_pages = desc->n_pages;
+        }
+    }
+    moe_spinlock_register(&cache_list_lock, "cache_list");
+}
+
+void mm_reclaim_boot_memory() {
+    if (!boot_ranges) return;
+    uintptr_t flags = io_lock_irq();
+    for (uintptr_t i = 0; i < n_boot_ranges; i++) {
+        mm_range_t *range = &boot_ranges[i];
+        mm_add_free_range(range->pfn, range->pfn + range->n_pages, 1);
+    }
+    io_restore_irq(flags);
+    moe_free_object(boot_ranges);
+    boot_ranges = NULL;
+    n_boot_ranges = 0;
+}
+
+
+/*********************************************************************/
+
+
+static uint32_t mm_rand(uint32_t *seed) {
+    uint32_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *seed = x;
+}
+
+static void mm_print_free_area() {
+    for (int i = 0; i < MAX_ZONES; i++) {
+        mm_zone_t *zone = &zones[i];
+        if (!zone->managed_pages) continue;
+        printf("%s/%d free pages %zu/%zu orders:", zone->name, zone->node, (size_t)zone->free_pages, (size_t)zone->managed_pages);
+        for (int j = 0; j < MAX_ORDER; j++) {
+            printf(" %zu", (size_t)zone->area[j].count);
+        }
+        printf("\n");
+    }
+}
+
+static uintptr_t mm_free_pages() {
+    uintptr_t free_pages = 0;
+    for (int i = 0; i < MAX_ZONES; i++) {
+        free_pages += zones[i].free_pages;
+    }
+    return free_pages;
+}
+
+// Page allocator stress test and benchmark
+int cmd_pgbench(int argc, char **argv) {
+    const int n_iterations = 100000;
+    struct {
+        uintptr_t pa;
+        size_t size;
+    } slots[PGBENCH_SLOTS];
+    uint32_t seed = 0x12345678;
+    size_t n_alloc = 0, n_free = 0, n_fail = 0;
+
+    mm_drain_pages();
+    uintptr_t initial_free = mm_free_pages();
+
+    memset(slots, 0, sizeof(slots));
+    mm_print_free_area();
+
+    moe_measure_t measure = moe_create_measure(0);
+    for (int i = 0; i < n_iterations; i++) {
+        int index = mm_rand(&seed) % PGBENCH_SLOTS;
+        if (slots[index].pa) {
+            moe_free_physical_page(slots[index].pa, slots[index].size);
+            slots[index].pa = 0;
+            n_free++;
+        } else {
+            // mostly single pages, sometimes up to 64 pages with odd sizes
+            uint32_t r = mm_rand(&seed);
+            size_t pages = ((r & 7) != 0) ? 1 : 1 + ((r >> 3) & 63);
+            uintptr_t pa = moe_alloc_physical_page(pages * PAGE_SIZE);
+            if (pa) {
+                slots[index].pa = pa;
+                slots[index].size = pages * PAGE_SIZE;
+                n_alloc++;
+            } else {
+                n_fail++;
+            }
+        }
+    }
+    int64_t elapsed = moe_measure_diff(measure);
+
+    // fragmentation: pages held in blocks of 2MB or larger
+    uintptr_t free_pages = mm_free_pages();
+    uintptr_t large_pages = 0;
+    for (int j = 0; j < MAX_ZONES; j++) {
+        for (int i = 9; i < MAX_ORDER; i++) {
+            large_pages += zones[j].area[i].count << i;
+        }
+    }
+    mm_print_free_area();
+    printf("fragmentation: %zu%% of free pages in blocks < 2MB\n",
+        free_pages ? (size_t)(100 - large_pages * 100 / free_pages) : (size_t)0);
+
+    for (int i = 0; i < PGBENCH_SLOTS; i++) {
+        if (slots[i].pa) {
+            moe_free_physical_page(slots[i].pa, slots[i].size);
+        }
+    }
+    mm_drain_pages();
+    mm_print_free_area();
+
+    if (elapsed <= 0) elapsed = 1;
+    printf("%zu allocs %zu frees %zu fails in %lld us (%lld ops/sec) leak %zd pages\n",
+        n_alloc, n_free, n_fail, elapsed, (int64_t)(n_alloc + n_free) * 1000000 / elapsed,
+        (intptr_t)(initial_free - mm_free_pages()));
+
+    return 0;
+}
+
+
+int cmd_meminfo(int argc, char **argv) {
+    uintptr_t free_pages = mm_free_pages();
+    printf("Total %zuMB Free %zuMB (%zu pages)\n",
+        (size_t)(total_memory >> 8), (size_t)(free_pages >> 8), (size_t)free_pages);
+    printf("ZONE     NODE RANGE                      MANAGED(MB) FREE(MB) RECLAIMED(MB)  ALLOCS   FREES\n");
+    for (int i = 0; i < MAX_ZONES; i++) {
+        mm_zone_t *zone = &zones[i];
+        if (!zone->managed_pages) continue;
+        printf("%s", zone->name);
+        for (size_t pad = strlen(zone->name); pad < 9; pad++) printf(" ");
+        printf("%4d ", zone->node);
+        printf("%012zx-%012zx %11zu %8zu %13zu %7zu %7zu\n",
+            (size_t)(zone->base_pfn << PAGE_SHIFT), (size_t)(zone->end_pfn << PAGE_SHIFT),
+            (size_t)(zone->managed_pages >> 8), (size_t)(zone->free_pages >> 8),
+            (size_t)(zone->reclaimed_pages >> 8), (size_t)zone->n_alloc, (size_t)zone->n_free);
+    }
+    for (int i = 0; i < MAX_ZONES; i++) {
+        mm_zone_t *zone = &zones[i];
+        zero_pool_t *pool = &zone->zero_pool;
+        if (!zone->managed_pages) continue;
+        printf("%s/%d zero pool: %u/%u pages, %zu zeroed, hit/miss %zu/%zu\n",
+            zone->name, zone->node, pool->count, ZERO_POOL_PAGES, (size_t)pool->zeroed,
+            (size_t)pool->hits, (size_t)pool->misses);
+    }
+    if (numa.n_nodes > 1) {
+        printf("NUMA %d nodes, distance:", numa.n_nodes);
+        for (int i = 0; i < numa.n_nodes; i++) {
+            printf(" [");
+            for (int j = 0; j < numa.n_nodes; j++) {
+                printf(j ? " %d" : "%d", numa.distance[i][j]);
+            }
+            printf("]");
+        }
+        printf("\n");
+        for (mm_cpu_t *cpu = cpu_list; cpu; cpu = cpu->next) {
+            printf(" CPU#%d node %d", cpu->cpuid, cpu->node);
+        }
+        printf("\n");
+    }
+
+    printf("CACHE                OBJ  INUSE  TOTAL SLAB(KB)  WASTE(KB)  PAGED(KB)\n");
+    size_t total_waste = 0, total_paged = 0;
+    // Take a snapshot so that cache_list_lock is not held while printing
+    size_t n_caches = 0;
+    moe_spinlock_acquire(&cache_list_lock);
+    for (moe_cache_t *cache = cache_list; cache; cache = cache->next) {
+        n_caches++;
+    }
+    moe_spinlock_release(&cache_list_lock);
+    cache_info_t *infos = moe_alloc_object(sizeof(cache_info_t), n_caches);
+    size_t n_infos = 0;
+    if (infos) {
+        moe_spinlock_acquire(&cache_list_lock);
+        for (moe_cache_t *cache = cache_list; cache && n_infos < n_caches; cache = cache->next) {
+            cache_info_t *info = &infos[n_infos++];
+            memcpy(info->name, cache->name, CACHE_NAME_SIZE);
+            info->name[CACHE_NAME_SIZE - 1] = '\0';
+            info->size = cache->size;
+            info->obj_size = cache->obj_size;
+            info->inuse = cache->n_inuse;
+            info->total = cache->n_slabs * cache->objs_per_slab;
+            info->slab_bytes = cache->n_slabs * ((size_t)PAGE_SIZE << cache->slab_order);
+        }
+        moe_spinlock_release(&cache_list_lock);
+    }
+    for (size_t i = 0; i < n_infos; i++) {
+        cache_info_t *info = &infos[i];
+        size_t inuse = info->inuse;
+        size_t waste = info->slab_bytes - inuse * info->size;
+        // what the same objects cost when each one took whole pages
+        size_t paged = inuse * ceil_pagesize(info->size);
+        total_waste += waste;
+        total_paged += paged - inuse * info->size;
+        char name[CACHE_NAME_SIZE];
+        size_t len = strlen(info->name);
+        memset(name, ' ', CACHE_NAME_SIZE - 1);
+        memcpy(name, info->name, MIN(len, 20));
+        name[20] = '\0';
+        printf("%s %4zu %6zu %6zu %8zu %10zu %10zu\n",
+            name, info->obj_size, inuse, info->total,
+            info->slab_bytes >> 10, waste >> 10, paged >> 10);
+    }
+    moe_free_object(infos);
+    for (mm_cpu_t *cpu = cpu_list; cpu; cpu = cpu->next) {
+        size_t cached = 0;
+        for (int i = 0; i < MAX_MAG_CACHES; i++) {
+            cached += cpu->mags[i].count;
+        }
+        printf("CPU#%d magazine: %u pages (%zu/%zu), %zu objects (%zu/%zu) hit/miss\n",
+            cpu->cpuid, cpu->n_pages, (size_t)cpu->page_hits, (size_t)cpu->page_misses,
+            cached, (size_t)cpu->obj_hits, (size_t)cpu->obj_misses);
+    }
+    size_t large_waste = large_allocated - large_requested;
+    printf("large objects %zu: %zuKB allocated, %zuKB wasted\n",
+        (size_t)large_count, (size_t)(large_allocated >> 10), large_waste >> 10);
+    pg_stat_t pg_stat;
+    pg_get_stat(&pg_stat);
+    printf("page tables: %zu PTEs written, %zu tables created, flushes %zu invlpg %zu full, %zu shootdowns\n",
+        (size_t)pg_stat.ptes_written, (size_t)pg_stat.tables_created,
+        (size_t)pg_stat.invlpg_flushes, (size_t)pg_stat.full_flushes, (size_t)pg_stat.shootdowns);
+    printf("direct map: %zuGB with %zuKB pages\n",
+        (size_t)(pg_stat.direct_map_size >> 30), (size_t)(pg_stat.direct_map_page_size >> 10));
+    size_t vm_areas, vm_size, vm_free;
+    pg_get_vm_info(&vm_areas, &vm_size, &vm_free);
+    printf("kernel heap: %zu areas %zuKB mapped, %zu free ranges\n", vm_areas, vm_size >> 10, vm_free);
+    printf("slab waste %zuKB (whole-page objects would waste %zuKB)\n", total_waste >> 10, total_paged >> 10);
+    for (moe_dma_pool_t *pool = dma_pool_list; pool; pool = pool->next) {
+        printf("dma pool %s: size %zu, %zu/%zu objects in use, %zu chunks %zuKB\n",
+            pool->name, pool->size, (size_t)pool->n_inuse, (size_t)pool->n_objects,
+            (size_t)pool->n_chunks, (size_t)((pool->n_chunks * pool->chunk_size) >> 10));
+    }
+
+    if (argc > 1 && !strncmp(argv[1], "bench", 6)) {
+        const int n_objects = 256;
+        void **objs = moe_alloc_object(sizeof(void *), n_objects);
+        const size_t obj_size = 40;
+
+        moe_measure_t measure = moe_create_measure(0);
+        for (int i = 0; i < n_objects; i++) {
+            objs[i] = alloc_large_object(obj_size, MM_ZERO);
+        }
+        for (int i = 0; i < n_objects; i++) {
+            free_large_object(objs[i]);
+        }
+        int64_t paged_time = MAX(moe_measure_diff(measure), 1);
+
+        measure = moe_create_measure(0);
+        for (int i = 0; i < n_objects; i++) {
+            objs[i] = moe_alloc_object(obj_size, 1);
+        }
+        for (int i = 0; i < n_objects; i++) {
+            moe_free_object(objs[i]);
+        }
+        int64_t slab_time = MAX(moe_measure_diff(measure), 1);
+
+        moe_free_object(objs);
+        printf("%d x %zu bytes: paged %lld allocs/sec, slab %lld allocs/sec\n",
+            n_objects, obj_size,
+            (int64_t)n_objects * 1000000 / paged_time, (int64_t)n_objects * 1000000 / slab_time);
+    }
+
+    return 0;
+}
+
+
+typedef struct {
+    _Atomic int ready, done;
+    _Atomic int go;
+    int n_iterations;
+    _Atomic int64_t elapsed;
+} mmbench_t;
+
+static void mmbench_thread(void *args) {
+    mmbench_t *bench = args;
+    uintptr_t pages[MMBENCH_BATCH];
+    void *objs[MMBENCH_BATCH];
+
+    atomic_fetch_add(&bench->ready, 1);
+    while (!bench->go) {
+        cpu_relax();
+    }
+    moe_measure_t measure = moe_create_measure(0);
+    for (int i = 0; i < bench->n_iterations; i++) {
+        for (int j = 0; j < MMBENCH_BATCH; j++) {
+            pages[j] = moe_alloc_physical_page(PAGE_SIZE);
+            objs[j] = moe_alloc_object(64, 1);
+        }
+        for (int j = 0; j < MMBENCH_BATCH; j++) {
+            moe_free_physical_page(pages[j], PAGE_SIZE);
+            moe_free_object(objs[j]);
+        }
+    }
+    atomic_fetch_add(&bench->elapsed, moe_measure_diff(measure));
+    atomic_fetch_add(&bench->done, 1);
+}
+
+static int64_t mmbench_run(int n_threads, int n_iterations) {
+    mmbench_t bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.n_iterations = n_iterations;
+    for (int i = 0; i < n_threads; i++) {
+        moe_create_thread(&mmbench_thread, 0, &bench, "mmbench");
+    }
+    while (bench.ready < n_threads) {
+        moe_usleep(1000);
+    }
+    bench.go = 1;
+    while (bench.done < n_threads) {
+        moe_usleep(1000);
+    }
+    int64_t elapsed = bench.elapsed / n_threads;
+    return MAX(elapsed, 1);
+}
+
+// Multi-core allocator benchmark: global pools vs per-CPU magazines
+int cmd_mmbench(int argc, char **argv) {
+    const int n_iterations = 10000;
+    int max_threads = moe_get_number_of_active_cpus();
+    if (argc > 1) {
+        max_threads = MAX(atoi(argv[1]), 1);
+    }
+
+    printf("threads       global   magazine  (ops/sec)\n");
+    for (int n_threads = 1; n_threads; n_threads = bench_next_threads(n_threads, max_threads)) {
+        int64_t ops = (int64_t)n_threads * n_iterations * MMBENCH_BATCH * 4;
+
+        mm_drain_all();
+        mm_magazines_enabled = 0;
+        int64_t global_time = mmbench_run(n_threads, n_iterations);
+        mm_magazines_enabled = 1;
+        int64_t mag_time = mmbench_run(n_threads, n_iterations);
+        mm_drain_all();
+
+        printf("%7d %10lld %10lld\n", n_threads, ops * 1000000 / global_time, ops * 1000000 / mag_time);
+    }
+    return 0;
 }
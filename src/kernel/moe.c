@@ -10,9 +10,15 @@
 #define DEFAULT_QUANTUM             3
 #define CONSUME_QUANTUM_THRESHOLD   2500
 #define THREAD_NAME_SIZE            32
-#define DEFAULT_SCHEDULE_SIZE       256
-#define N_SCHEDULE_QUEUE            2
-#define MAX_THREADS                 256
+#define N_SCHEDULE_QUEUE            (priority_max - 1)
+#define AGING_THRESHOLD             16
+#define THREAD_TABLE_CHUNK          256
+#define THREAD_TABLE_DIRS           256
+#define MAX_THREADS                 (THREAD_TABLE_CHUNK * THREAD_TABLE_DIRS)
+#define STACK_POOL_SIZE             32
+#define FIBER_STACK_POOL_SIZE       256
+#define REAPER_INTERVAL             100000
+#define MAX_STEAL_TRIES             4
 
 typedef uint32_t moe_affinity_t;
 typedef int context_id;
@@ -22,6 +28,14 @@ typedef union {
     uint8_t context_save_area[CONTEXT_SAVE_AREA_SIZE];
 } cpu_context_t;
 
+// Callee-saved registers only, laid out as the head of cpu_context_t
+#define FIBER_CONTEXT_SAVE_AREA_SIZE    0x50
+typedef union {
+    uint8_t context_save_area[FIBER_CONTEXT_SAVE_AREA_SIZE];
+} fiber_context_t;
+
+typedef struct fiber_sched_t fiber_sched_t;
+
 typedef struct moe_thread_t {
     cpu_context_t context;
     char name[THREAD_NAME_SIZE];
@@ -40,6 +54,7 @@ typedef struct moe_thread_t {
             unsigned running:1;
             unsigned zombie:1;
             unsigned last_cpuid:8;
+            unsigned boosted:1;
         };
     };
 
@@ -52,9 +67,65 @@ typedef struct moe_thread_t {
     _Atomic int load0, load;
     _Atomic uint8_t quantum_left;
     uint8_t quantum;
+    uint32_t n_migrations;
+
+    void *stack;
+    size_t stack_size;
+    moe_thread_t *next_zombie;
+    int node;
 
+    // Link in a run list; a thread is on at most one of them
+    moe_thread_t *next_run;
+
+    // Sleeping threads are kept in a pairing heap of timer_cpu
+    moe_measure_t timer_deadline;
+    moe_thread_t *timer_child, *timer_sibling, *timer_prev;
+    int timer_queued, timer_cpu;
+    _Atomic int sleeping;
+    _Atomic int permit;
+
+    // Created on the first moe_create_fiber
+    fiber_sched_t *fibers;
 } moe_thread_t;
 
+typedef struct {
+    moe_thread_t *head, *tail;
+    _Atomic int count;
+} sch_list_t;
+
+typedef struct moe_fiber_t {
+    fiber_context_t context;
+    fiber_sched_t *sched;
+    // Link in the ready list, or in the woken list while another thread hands it back
+    struct moe_fiber_t *next, *prev;
+    // Blocked fibers with a timeout are kept in a list sorted by deadline
+    struct moe_fiber_t *timer_next, *timer_prev;
+    moe_measure_t deadline;
+    struct moe_fiber_t *joiner;
+    void *stack;
+    size_t stack_size;
+    context_id fibid;
+    int exit_code;
+    unsigned queued:1;
+    unsigned timer_queued:1;
+    unsigned dead:1;
+    _Atomic int blocked;
+    _Atomic int permit;
+} moe_fiber_t;
+
+// Fibers of a thread; the thread itself runs as the main fiber
+typedef struct fiber_sched_t {
+    moe_fiber_t main;
+    moe_fiber_t *current;
+    moe_thread_t *thread;
+    moe_fiber_t *ready_head, *ready_tail;
+    moe_fiber_t *timer_head;
+    moe_spinlock_t lock;
+    moe_fiber_t *woken_head, *woken_tail;
+    int n_fibers;
+    uintptr_t n_switches;
+} fiber_sched_t;
+
 
 typedef enum {
     moe_irql_passive,
@@ -71,21 +142,35 @@ typedef union {
         _Atomic (moe_thread_t*) current;
         _Atomic (moe_thread_t*) retired;
         _Atomic moe_irql_t irql;
+        void *mm;
+        int node;
+        // Run lists of this CPU, one per priority; rq_lock guards ready[] and woken.
+        // Other CPUs take it only to queue work here or to steal, so the owner rarely waits on it,
+        // and ready_bitmap and the counts can be read without it
+        moe_spinlock_t rq_lock;
+        sch_list_t ready[N_SCHEDULE_QUEUE];
+        _Atomic uint32_t ready_bitmap;
+        sch_list_t waiting;
+        sch_list_t woken;
+        moe_thread_t *timer_root;
+        int n_timers;
+        int aging;
+        int tick_stopped;
+        _Atomic int is_idle;
+        uintptr_t irqs_last, irq_rate;
+        _Atomic uintptr_t n_switches, n_steals, n_aged;
     };
 } core_specific_data_t;
 
 static struct {
-    _Atomic (moe_thread_t *) *thread_list;
+    moe_cache_t *thread_cache;
+    moe_cache_t *fiber_cache;
     core_specific_data_t *csd;
-    moe_queue_t *ready[N_SCHEDULE_QUEUE];
-    moe_queue_t *retired;
-    _Atomic context_id next_thid;
     _Atomic context_id next_fibid;
     _Atomic context_id next_pid;
     moe_affinity_t system_affinity;
     int ncpu;
     _Atomic int n_active_cpu;
-    atomic_flag lock;
 } moe;
 
 extern void _do_switch_context(cpu_context_t *from, cpu_context_t *to);
@@ -93,31 +178,184 @@ extern void cpu_finit(void);
 extern void cpu_fsave(cpu_context_t *ctx);
 extern void cpu_fload(cpu_context_t *ctx);
 extern void io_setup_new_thread(cpu_context_t *context, uintptr_t* new_sp, moe_thread_start start, void *args);
+extern void _do_switch_fiber(fiber_context_t *from, fiber_context_t *to);
+extern void io_setup_new_fiber(fiber_context_t *context, uintptr_t* new_sp, moe_fiber_start start, void *args);
 extern int smp_get_current_cpuid();
 
 
 /*********************************************************************/
 
 
-static int thread_index_of(moe_thread_t *thread) {
-    for (size_t i = 0; i < MAX_THREADS; i++) {
-        if (moe.thread_list[i] == thread) {
-            return i;
+// Threads are indexed by thid in a two-level table; free slots hold ((next free + 1) << 1) | 1
+static struct {
+    moe_spinlock_t lock;
+    _Atomic uintptr_t *_Atomic chunks[THREAD_TABLE_DIRS];
+    _Atomic int n_slots;
+    int free_head; // thid + 1 of the first free slot, or 0
+    _Atomic int n_threads;
+} thread_table;
+
+static _Atomic uintptr_t *thread_slot(int thid) {
+    return &thread_table.chunks[thid / THREAD_TABLE_CHUNK][thid % THREAD_TABLE_CHUNK];
+}
+
+static moe_thread_t *thread_get(int thid) {
+    if (thid < 0 || thid >= atomic_load(&thread_table.n_slots)) return NULL;
+    uintptr_t value = atomic_load(thread_slot(thid));
+    return (value & 1) ? NULL : (moe_thread_t *)value;
+}
+
+// Assigns a thid to the thread; the chunk memory is allocated outside the lock
+static int thread_table_add(moe_thread_t *thread) {
+    for (;;) {
+        int thid = -1;
+        uintptr_t flags = moe_spinlock_acquire_irq(&thread_table.lock);
+        if (thread_table.free_head) {
+            thid = thread_table.free_head - 1;
+            thread_table.free_head = (int)(atomic_load(thread_slot(thid)) >> 1);
+        } else {
+            int n_slots = thread_table.n_slots;
+            if (n_slots < MAX_THREADS && thread_table.chunks[n_slots / THREAD_TABLE_CHUNK]) {
+                thid = n_slots;
+                atomic_store(&thread_table.n_slots, n_slots + 1);
+            }
+        }
+        if (thid >= 0) {
+            atomic_store(thread_slot(thid), (uintptr_t)thread);
+            thread_table.n_threads++;
+        }
+        int n_slots = thread_table.n_slots;
+        moe_spinlock_release_irq(&thread_table.lock, flags);
+        if (thid >= 0) return thid;
+        if (n_slots >= MAX_THREADS) return -1;
+
+        _Atomic uintptr_t *chunk = moe_alloc_object(sizeof(uintptr_t), THREAD_TABLE_CHUNK);
+        if (!chunk) return -1;
+        memset(chunk, 0, sizeof(uintptr_t) * THREAD_TABLE_CHUNK);
+        _Atomic uintptr_t *expected = NULL;
+        if (!atomic_compare_exchange_strong(&thread_table.chunks[n_slots / THREAD_TABLE_CHUNK], &expected, chunk)) {
+            moe_free_object(chunk);
         }
     }
-    return -1;
+}
+
+static void thread_table_remove(moe_thread_t *thread) {
+    int thid = thread->thid;
+    uintptr_t flags = moe_spinlock_acquire_irq(&thread_table.lock);
+    if (thread_get(thid) == thread) {
+        atomic_store(thread_slot(thid), ((uintptr_t)thread_table.free_head << 1) | 1);
+        thread_table.free_head = thid + 1;
+        thread_table.n_threads--;
+    }
+    moe_spinlock_release_irq(&thread_table.lock, flags);
+}
+
+// Thread stacks have an unmapped guard page on each side; default sized ones are recycled
+typedef struct {
+    moe_spinlock_t lock;
+    int count, limit;
+    size_t size;
+    void *head; // Pooled stacks are linked through their first word
+    _Atomic uintptr_t hits, misses;
+} stack_pool_t;
+
+static stack_pool_t stack_pool = { .limit = STACK_POOL_SIZE, .size = MOE_DEFAULT_STACK_SIZE };
+static stack_pool_t fiber_stack_pool = { .limit = FIBER_STACK_POOL_SIZE, .size = MOE_FIBER_STACK_SIZE };
+
+// Dead threads are handed to the reaper, as their last release may happen inside the scheduler
+static struct {
+    _Atomic (moe_thread_t *) zombies;
+    _Atomic uintptr_t reaped;
+} reaper;
+
+static stack_pool_t *stack_pool_of(size_t size) {
+    if (size == stack_pool.size) return &stack_pool;
+    if (size == fiber_stack_pool.size) return &fiber_stack_pool;
+    return NULL;
+}
+
+static void *stack_pool_get(stack_pool_t *pool) {
+    void *stack = NULL;
+    uintptr_t flags = moe_spinlock_acquire_irq(&pool->lock);
+    if (pool->head) {
+        stack = pool->head;
+        pool->head = *(void **)stack;
+        pool->count--;
+    }
+    moe_spinlock_release_irq(&pool->lock, flags);
+    return stack;
+}
+
+static void stack_free(void *stack, size_t size) {
+    stack_pool_t *pool = stack_pool_of(size);
+    if (pool) {
+        uintptr_t flags = moe_spinlock_acquire_irq(&pool->lock);
+        int pooled = pool->count < pool->limit;
+        if (pooled) {
+            *(void **)stack = pool->head;
+            pool->head = stack;
+            pool->count++;
+        }
+        moe_spinlock_release_irq(&pool->lock, flags);
+        if (pooled) return;
+    }
+    uintptr_t pa = pg_va2pa(stack);
+    size_t sz = pg_vfree(stack);
+    moe_free_physical_page(pa, sz);
+}
+
+static int reap_zombies() {
+    int count = 0;
+    moe_thread_t *zombie = atomic_exchange(&reaper.zombies, NULL);
+    while (zombie) {
+        moe_thread_t *next = zombie->next_zombie;
+        if (zombie->stack) {
+            stack_free(zombie->stack, zombie->stack_size);
+        }
+        if (zombie->fibers) {
+            moe_free_object(zombie->fibers);
+        }
+        moe_cache_free(moe.thread_cache, zombie);
+        zombie = next;
+        count++;
+    }
+    atomic_fetch_add(&reaper.reaped, count);
+    return count;
+}
+
+static void *stack_alloc(size_t size, int node) {
+    stack_pool_t *pool = stack_pool_of(size);
+    if (pool) {
+        void *stack = stack_pool_get(pool);
+        if (!stack && pool == &stack_pool && reap_zombies()) {
+            stack = stack_pool_get(pool);
+        }
+        if (stack) {
+            atomic_fetch_add(&pool->hits, 1);
+            return stack;
+        }
+        atomic_fetch_add(&pool->misses, 1);
+    }
+    uintptr_t pa = mm_alloc_pages_node(size, 0, node);
+    if (!pa) return NULL;
+    void *stack = pg_valloc_guarded(pa, size);
+    if (!stack) {
+        moe_free_physical_page(pa, size);
+    }
+    return stack;
 }
 
 static void thread_dealloc(void *context) {
     moe_thread_t *self = context;
-    int index = thread_index_of(self);
-    atomic_compare_exchange_strong(&moe.thread_list[index], &self, NULL);
-    // TODO: release buffer
+    thread_table_remove(self);
+    moe_thread_t *head = atomic_load(&reaper.zombies);
+    do {
+        self->next_zombie = head;
+    } while (!atomic_compare_exchange_weak(&reaper.zombies, &head, self));
 }
 
 static void thread_release(moe_thread_t *thread) {
-    int index = thread_index_of(thread);
-    if (index < 0) return;
+    if (thread_get(thread->thid) != thread) return;
     moe_release(&thread->shared, &thread_dealloc);
 }
 
@@ -142,62 +380,447 @@ static moe_thread_t *_get_current_thread() {
     return current;
 }
 
-static int sch_add(moe_thread_t *thread) {
+/*********************************************************************/
+// Timer heap of sleeping threads, owned by each CPU
+// A pairing heap linked through the threads, so it never needs memory of its own
+
+static int timer_before(moe_measure_t a, moe_measure_t b) {
+    if (a == MOE_FOREVER) return 0;
+    if (b == MOE_FOREVER) return 1;
+    return (int64_t)(a - b) < 0;
+}
+
+// Links the later root under the earlier one; both must be detached roots
+static moe_thread_t *timer_meld(moe_thread_t *a, moe_thread_t *b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (timer_before(b->timer_deadline, a->timer_deadline)) {
+        moe_thread_t *t = a;
+        a = b;
+        b = t;
+    }
+    b->timer_prev = a;
+    b->timer_sibling = a->timer_child;
+    if (a->timer_child) a->timer_child->timer_prev = b;
+    a->timer_child = b;
+    return a;
+}
+
+// Two-pass pairing of a sibling list into a single root
+static moe_thread_t *timer_merge_pairs(moe_thread_t *first) {
+    moe_thread_t *pairs = NULL;
+    while (first) {
+        moe_thread_t *a = first, *b = a->timer_sibling;
+        first = b ? b->timer_sibling : NULL;
+        a->timer_sibling = a->timer_prev = NULL;
+        if (b) b->timer_sibling = b->timer_prev = NULL;
+        moe_thread_t *pair = timer_meld(a, b);
+        pair->timer_sibling = pairs;
+        pairs = pair;
+    }
+    moe_thread_t *root = NULL;
+    while (pairs) {
+        moe_thread_t *next = pairs->timer_sibling;
+        pairs->timer_sibling = NULL;
+        root = timer_meld(root, pairs);
+        pairs = next;
+    }
+    return root;
+}
+
+static void timer_insert(core_specific_data_t *csd, moe_thread_t *thread) {
+    thread->timer_child = thread->timer_sibling = thread->timer_prev = NULL;
+    thread->timer_queued = 1;
+    csd->timer_root = timer_meld(csd->timer_root, thread);
+    csd->n_timers++;
+}
+
+static void timer_remove(core_specific_data_t *csd, moe_thread_t *thread) {
+    moe_thread_t *children = timer_merge_pairs(thread->timer_child);
+    if (thread == csd->timer_root) {
+        csd->timer_root = children;
+    } else {
+        moe_thread_t *prev = thread->timer_prev;
+        if (prev->timer_child == thread) {
+            prev->timer_child = thread->timer_sibling;
+        } else {
+            prev->timer_sibling = thread->timer_sibling;
+        }
+        if (thread->timer_sibling) thread->timer_sibling->timer_prev = prev;
+        csd->timer_root = timer_meld(csd->timer_root, children);
+    }
+    thread->timer_child = thread->timer_sibling = thread->timer_prev = NULL;
+    thread->timer_queued = 0;
+    csd->n_timers--;
+}
+
+
+/*********************************************************************/
+// Scheduler
+
+// Ready queue index of a thread; a boosted low thread runs as normal
+static int sch_index(moe_thread_t *thread) {
+    return thread->priority + thread->boosted - 1;
+}
+
+static int sch_quantum(moe_priority_level_t priority) {
+    return DEFAULT_QUANTUM * priority;
+}
+
+static void sch_list_push(sch_list_t *list, moe_thread_t *thread) {
+    thread->next_run = NULL;
+    if (list->tail) {
+        list->tail->next_run = thread;
+    } else {
+        list->head = thread;
+    }
+    list->tail = thread;
+    list->count++;
+}
+
+// Unlinks thread, which follows prev (NULL for the head)
+static void sch_list_unlink(sch_list_t *list, moe_thread_t *prev, moe_thread_t *thread) {
+    if (prev) {
+        prev->next_run = thread->next_run;
+    } else {
+        list->head = thread->next_run;
+    }
+    if (list->tail == thread) list->tail = prev;
+    thread->next_run = NULL;
+    list->count--;
+}
+
+static moe_thread_t *sch_list_pop(sch_list_t *list) {
+    moe_thread_t *thread = list->head;
+    if (thread) sch_list_unlink(list, NULL, thread);
+    return thread;
+}
+
+static uintptr_t sch_lock(core_specific_data_t *csd) {
+    uintptr_t flags = moe_spinlock_acquire_irq(&csd->rq_lock);
+    return flags;
+}
+
+static void sch_unlock(core_specific_data_t *csd, uintptr_t flags) {
+    moe_spinlock_release_irq(&csd->rq_lock, flags);
+}
+
+static size_t sch_ready_count(core_specific_data_t *csd) {
+    size_t count = 0;
+    for (int i = 0; i < N_SCHEDULE_QUEUE; i++) {
+        count += atomic_load(&csd->ready[i].count);
+    }
+    return count;
+}
+
+// Must be called with rq_lock held
+static void sch_add_locked(core_specific_data_t *csd, moe_thread_t *thread) {
+    int index = sch_index(thread);
+    sch_list_push(&csd->ready[index], thread);
+    atomic_fetch_or(&csd->ready_bitmap, 1 << index);
+}
+
+// Queues a runnable thread on the given CPU
+static int sch_add(core_specific_data_t *csd, moe_thread_t *thread) {
     if (thread->priority) {
-        int pri = thread->priority >= priority_high ? 0 : 1;
-        return moe_queue_write(moe.ready[pri], (uintptr_t)thread);
+        uintptr_t flags = sch_lock(csd);
+        sch_add_locked(csd, thread);
+        sch_unlock(csd, flags);
+        return 0;
     } else {
         return -1;
     }
 }
 
-static int sch_retire(moe_thread_t *thread) {
+// Claims an idle CPU within allowed, preferring the affinity mask and then the same node
+static int sch_claim_idle(core_specific_data_t *csd, moe_affinity_t affinity, moe_affinity_t allowed) {
+    int candidate = -1, score = 0;
+    for (int i = 0; i < moe.ncpu; i++) {
+        core_specific_data_t *peer = &moe.csd[i];
+        if (peer == csd || !(allowed & AFFINITY(i)) || !atomic_load(&peer->is_idle)) continue;
+        int s = (affinity & AFFINITY(i)) ? 3 : (peer->node == csd->node) ? 2 : 1;
+        if (s > score) {
+            candidate = i;
+            score = s;
+        }
+    }
+    if (candidate < 0) return -1;
+    int expected = 1;
+    if (!atomic_compare_exchange_strong(&moe.csd[candidate].is_idle, &expected, 0)) return -1;
+    return candidate;
+}
+
+// A CPU the thread may run on, preferring the one it ran on last
+static int sch_allowed_cpu(moe_thread_t *thread) {
+    moe_affinity_t allowed = thread->strong_affinity & moe.system_affinity;
+    if (thread->weak_affinity & allowed) {
+        return __builtin_ctz(thread->weak_affinity & allowed);
+    }
+    return allowed ? __builtin_ctz(allowed) : 0;
+}
+
+// Makes a thread runnable, handing it to an idle CPU if this one is busy or not allowed
+static int sch_make_ready(core_specific_data_t *csd, moe_thread_t *thread) {
+    int allowed = (thread->strong_affinity & AFFINITY(csd->cpuid)) != 0;
+    if (!allowed || csd->current != csd->idle) {
+        int target = sch_claim_idle(csd, thread->weak_affinity, thread->strong_affinity);
+        if (target >= 0) {
+            int retval = sch_add(&moe.csd[target], thread);
+            smp_send_reschedule(target);
+            return retval;
+        }
+    }
+    if (!allowed) {
+        // Every allowed CPU is busy, so it waits for its turn there
+        return sch_add(&moe.csd[sch_allowed_cpu(thread)], thread);
+    }
+    return sch_add(csd, thread);
+}
+
+// Wakes up an idle CPU to steal surplus work from us
+static void sch_kick_idle(core_specific_data_t *csd) {
+    int target = sch_claim_idle(csd, 0, moe.system_affinity);
+    if (target >= 0) {
+        smp_send_reschedule(target);
+    }
+}
+
+// Takes a thread from the highest non-empty ready queue
+static moe_thread_t *sch_pick(core_specific_data_t *csd) {
+    const uint32_t low_bit = 1 << (priority_low - 1);
+    moe_thread_t *thread = NULL;
+    // Nothing to take, and anything queued meanwhile is found on the next pass
+    if (!atomic_load(&csd->ready_bitmap)) return NULL;
+    uintptr_t flags = sch_lock(csd);
+    uint32_t bitmap = atomic_load(&csd->ready_bitmap);
+    if (bitmap) {
+        int index = 31 - __builtin_clz(bitmap);
+        // Don't let normal and higher threads starve low ones forever
+        if (index > 0 && (bitmap & low_bit) && ++csd->aging > AGING_THRESHOLD) {
+            index = 0;
+        }
+        thread = sch_list_pop(&csd->ready[index]);
+        if (!csd->ready[index].head) {
+            atomic_fetch_and(&csd->ready_bitmap, ~(1 << index));
+        }
+    }
+    sch_unlock(csd, flags);
+    return thread;
+}
+
+// Puts a blocked thread in the timer heap until it expires or is signaled
+static void sch_sleep(core_specific_data_t *csd, moe_thread_t *thread) {
+    thread->timer_deadline = thread->deadline;
+    thread->timer_cpu = csd->cpuid;
+    timer_insert(csd, thread);
+    atomic_store(&thread->sleeping, 1);
+    // Signaled before it was asleep
+    if (!moe_measure_until(thread->deadline)) {
+        int expected = 1;
+        if (atomic_compare_exchange_strong(&thread->sleeping, &expected, 0)) {
+            timer_remove(csd, thread);
+            sch_list_push(&csd->waiting, thread);
+        }
+    }
+}
+
+// Hands a signaled thread back to the CPU holding it in its timer heap
+static void sch_wakeup(moe_thread_t *thread) {
+    int expected = 1;
+    if (atomic_compare_exchange_strong(&thread->sleeping, &expected, 0)) {
+        core_specific_data_t *owner = &moe.csd[thread->timer_cpu];
+        uintptr_t flags = sch_lock(owner);
+        sch_list_push(&owner->woken, thread);
+        sch_unlock(owner, flags);
+        if (atomic_load(&owner->is_idle)) {
+            smp_send_reschedule(thread->timer_cpu);
+        }
+    }
+}
+
+// Makes signaled and expired sleepers of the current CPU ready
+static void sch_expire(core_specific_data_t *csd) {
+    moe_thread_t *thread = NULL;
+    if (atomic_load(&csd->woken.count)) {
+        uintptr_t flags = sch_lock(csd);
+        thread = csd->woken.head;
+        csd->woken.head = csd->woken.tail = NULL;
+        csd->woken.count = 0;
+        sch_unlock(csd, flags);
+    }
+    while (thread) {
+        moe_thread_t *next = thread->next_run;
+        if (thread->timer_queued) {
+            timer_remove(csd, thread);
+        }
+        sch_make_ready(csd, thread);
+        thread = next;
+    }
+    while (csd->timer_root) {
+        thread = csd->timer_root;
+        if (timer_before(moe_create_measure(0), thread->timer_deadline)) break;
+        timer_remove(csd, thread);
+        // Otherwise sch_wakeup has already queued it to woken
+        int expected = 1;
+        if (atomic_compare_exchange_strong(&thread->sleeping, &expected, 0)) {
+            sch_make_ready(csd, thread);
+        }
+    }
+}
+
+// Parks a thread that has just been switched out on the current CPU
+static int sch_retire(core_specific_data_t *csd, moe_thread_t *thread) {
     if (!thread) return 0;
     if (thread->zombie) {
         thread_release(thread);
         return 0;
     }
     if (thread->priority) {
-        while (atomic_flag_test_and_set(&moe.lock)) {
-            cpu_relax();
+        if (moe_measure_until(thread->deadline)) {
+            sch_sleep(csd, thread);
+            return 0;
         }
-        int retval = moe_queue_write(moe.retired, (intptr_t)thread);
-        atomic_flag_clear(&moe.lock);
-        return retval;
+        sch_list_push(&csd->waiting, thread);
+        return 0;
     } else {
         return -1;
     }
 }
 
+// Takes a thread from the busiest peer, preferring peers on the same node
+static moe_thread_t *sch_steal(core_specific_data_t *csd) {
+    core_specific_data_t *victim = NULL;
+    size_t max_count = 0;
+    int victim_near = 0;
+    for (int i = 0; i < moe.ncpu; i++) {
+        core_specific_data_t *peer = &moe.csd[i];
+        if (peer == csd) continue;
+        size_t count = sch_ready_count(peer);
+        int near = (peer->node == csd->node);
+        if (count && ((near && !victim_near) || (near == victim_near && count > max_count))) {
+            victim = peer;
+            max_count = count;
+            victim_near = near;
+        }
+    }
+    if (!victim) return NULL;
+
+    // Take a thread that ran here before if there is one, and leave pinned ones alone
+    moe_affinity_t self = AFFINITY(csd->cpuid);
+    moe_thread_t *candidate = NULL;
+    uintptr_t flags = sch_lock(victim);
+    for (int i = N_SCHEDULE_QUEUE - 1; i >= 0 && !candidate; i--) {
+        sch_list_t *list = &victim->ready[i];
+        moe_thread_t *prev = NULL, *candidate_prev = NULL;
+        int scanned = 0;
+        for (moe_thread_t *thread = list->head; thread && scanned < MAX_STEAL_TRIES; prev = thread, thread = thread->next_run, scanned++) {
+            if (!(thread->strong_affinity & self)) continue;
+            if (!candidate || (thread->weak_affinity & self)) {
+                candidate = thread;
+                candidate_prev = prev;
+                if (thread->weak_affinity & self) break;
+            }
+        }
+        if (candidate) {
+            sch_list_unlink(list, candidate_prev, candidate);
+            if (!list->head) {
+                atomic_fetch_and(&victim->ready_bitmap, ~(1 << i));
+            }
+        }
+    }
+    sch_unlock(victim, flags);
+    if (candidate) {
+        atomic_fetch_add(&csd->n_steals, 1);
+    }
+    return candidate;
+}
+
 static moe_thread_t *sch_next() {
+    core_specific_data_t *csd = _get_current_csd();
+    sch_expire(csd);
     for (int retry = 0; retry < 2; retry++) {
 
     moe_thread_t *thread;
-    do {
-        for(int i = 0; i < N_SCHEDULE_QUEUE; i++) {
-            thread = (moe_thread_t*)moe_queue_read(moe.ready[i], 0);
-            if (thread) {
-                if (moe_measure_until(thread->deadline)) {
-                    sch_retire(thread);
-                } else {
-                    return thread;
-                }
+    while ((thread = sch_pick(csd))) {
+        if (moe_measure_until(thread->deadline)) {
+            sch_retire(csd, thread);
+        } else if (!(thread->strong_affinity & AFFINITY(csd->cpuid))) {
+            // Its affinity was changed while it was queued here
+            sch_make_ready(csd, thread);
+        } else {
+            if (thread->priority == priority_low && csd->aging > AGING_THRESHOLD) {
+                // Let it run a full quantum at normal priority
+                thread->boosted = 1;
+                atomic_fetch_add(&csd->n_aged, 1);
+            }
+            if (thread->priority == priority_low) {
+                csd->aging = 0;
             }
+            return thread;
         }
-    } while (thread);
+    }
 
-    //  Wait queue is empty
-    if (!atomic_flag_test_and_set(&moe.lock)) {
+    //  Ready queues are empty
+    if (csd->waiting.head) {
+        uintptr_t flags = sch_lock(csd);
         moe_thread_t *p;
-        while ((p = (moe_thread_t*)moe_queue_read(moe.retired, 0))) {
-            sch_add(p);
+        while ((p = sch_list_pop(&csd->waiting))) {
+            sch_add_locked(csd, p);
         }
-        atomic_flag_clear(&moe.lock);
+        sch_unlock(csd, flags);
+    }
+    if (sch_ready_count(csd) > 1) {
+        sch_kick_idle(csd);
+    }
+
     }
 
+    moe_thread_t *stolen = sch_steal(csd);
+    if (stolen && moe_measure_until(stolen->deadline)) {
+        sch_retire(csd, stolen);
+        stolen = NULL;
+    }
+    if (stolen) return stolen;
+
+    return csd->idle;
+}
+
+
+static void sch_restart_tick(core_specific_data_t *csd) {
+    smp_restart_tick();
+    csd->tick_stopped = 0;
+}
+
+// Stops ticking while idle, waking up at the earliest timer
+static void sch_stop_tick(core_specific_data_t *csd) {
+    int64_t us = -1;
+    if (csd->timer_root && csd->timer_root->timer_deadline != MOE_FOREVER) {
+        us = MAX(-moe_measure_diff(csd->timer_root->timer_deadline), 0);
+    }
+    if (!smp_stop_tick(us)) {
+        // A timer was added after it stopped without one
+        if (csd->tick_stopped) {
+            sch_restart_tick(csd);
+        }
+        return;
+    }
+    csd->tick_stopped = 1;
+    // Work queued while stopping would not have woken us up
+    if (sch_ready_count(csd) || csd->waiting.count || atomic_load(&csd->woken.count)) {
+        sch_restart_tick(csd);
     }
+}
 
-    return _get_current_csd()->idle;
+static void sch_update_tick(core_specific_data_t *csd) {
+    if (csd->current == csd->idle) {
+        atomic_store(&csd->is_idle, 1);
+        sch_stop_tick(csd);
+    } else {
+        atomic_store(&csd->is_idle, 0);
+        if (csd->tick_stopped) {
+            sch_restart_tick(csd);
+        }
+    }
 }
 
 
@@ -216,20 +839,25 @@ static void _next_thread(core_specific_data_t *csd, moe_thread_t *current) {
         csd->current = next;
         next->running = 1;
         csd->retired = current;
+        atomic_fetch_add(&csd->n_switches, 1);
         _do_switch_context(&current->context, &next->context);
         csd = _get_current_csd();
         moe_thread_t *current = csd->current;
         current->measure = moe_create_measure(0);
         current->signal_object = NULL;
+        if (current->weak_affinity && !(current->weak_affinity & AFFINITY(csd->cpuid))) {
+            current->n_migrations++;
+        }
         current->last_cpuid = csd->cpuid;
         current->weak_affinity = AFFINITY(csd->cpuid);
-        sch_retire(atomic_exchange(&csd->retired, NULL));
+        sch_retire(csd, atomic_exchange(&csd->retired, NULL));
     } else {
         int64_t load = moe_measure_diff(current->measure);
         atomic_fetch_add(&current->cputime, load);
         atomic_fetch_add(&current->load0, load);
         current->measure = moe_create_measure(0);
     }
+    sch_update_tick(csd);
 }
 
 void thread_on_start() {
@@ -238,7 +866,8 @@ void thread_on_start() {
     current->last_cpuid = csd->cpuid;
     current->weak_affinity = AFFINITY(csd->cpuid);
     current->measure = moe_create_measure(0);
-    sch_retire(atomic_exchange(&csd->retired, NULL));
+    sch_retire(csd, atomic_exchange(&csd->retired, NULL));
+    sch_update_tick(csd);
 }
 
 
@@ -264,17 +893,50 @@ int moe_wait_for_object(_Atomic (moe_thread_t *) *obj, int64_t us) {
     }
     current->deadline = moe_create_measure(us);
     current->signal_object = obj;
+    current->boosted = 0;
     _next_thread(csd, current);
     io_restore_irq(flags);
     return 0;
 }
 
 
+// Blocks until thread_unpark or timeout; returns 0 if unparked, may return early
+static int thread_park(int64_t us) {
+    uintptr_t flags = io_lock_irq();
+    core_specific_data_t *csd = _get_current_csd();
+    moe_thread_t *current = csd->current;
+    if (!atomic_exchange(&current->permit, 0)) {
+        current->deadline = moe_create_measure(us);
+        current->signal_object = NULL;
+        current->boosted = 0;
+        // An unpark between the exchange and setting the deadline would be lost otherwise
+        if (!atomic_load(&current->permit)) {
+            _next_thread(csd, current);
+        } else {
+            current->deadline = 0;
+        }
+        if (!atomic_exchange(&current->permit, 0)) {
+            io_restore_irq(flags);
+            return -1;
+        }
+    }
+    io_restore_irq(flags);
+    return 0;
+}
+
+static void thread_unpark(moe_thread_t *thread) {
+    atomic_store(&thread->permit, 1);
+    thread->deadline = 0;
+    sch_wakeup(thread);
+}
+
+
 int moe_signal_object(_Atomic (moe_thread_t *) *obj) {
     moe_thread_t *thread = *obj;
     _Atomic (moe_thread_t *) *signal_object = thread->signal_object;
     if (signal_object && atomic_compare_exchange_strong(thread->signal_object, &thread, NULL)) {
         thread->deadline = 0;
+        sch_wakeup(thread);
         return 0;
     } else {
         return -1;
@@ -282,37 +944,53 @@ int moe_signal_object(_Atomic (moe_thread_t *) *obj) {
 }
 
 
-static moe_thread_t *_create_thread(moe_thread_start start, moe_priority_level_t priority, void *args, const char *name) {
-    moe_thread_t *new_thread = moe_alloc_object(sizeof(moe_thread_t), 1);
+static moe_thread_t *_create_thread(moe_thread_start start, moe_priority_level_t priority, void *args, const char *name, size_t stack_size) {
+    void *stack = NULL;
+    stack_size = (stack_size + 0xFFF) & ~0xFFF;
+    // New threads belong to the creator's node, and their stacks come from its memory
+    int node = moe.csd ? moe_get_current_node() : 0;
+    if (start) {
+        stack = stack_alloc(stack_size, node);
+        if (!stack) return NULL;
+    }
+    moe_thread_t *new_thread = moe_cache_alloc(moe.thread_cache);
+    if (!new_thread) {
+        if (stack) stack_free(stack, stack_size);
+        return NULL;
+    }
     moe_shared_init(&new_thread->shared, new_thread);
-    new_thread->thid = atomic_fetch_add(&moe.next_thid, 1);
-    new_thread->pid = _get_current_thread()->pid;
+    new_thread->thid = thread_table_add(new_thread);
+    if (new_thread->thid < 0) {
+        moe_cache_free(moe.thread_cache, new_thread);
+        if (stack) stack_free(stack, stack_size);
+        return NULL;
+    }
+    new_thread->pid = moe.csd ? _get_current_thread()->pid : 0;
     new_thread->priority = priority;
+    new_thread->node = node;
     if (priority) {
-        new_thread->quantum = priority;
-        new_thread->quantum_left = DEFAULT_QUANTUM * priority * priority;
+        new_thread->quantum = sch_quantum(priority);
+        new_thread->quantum_left = new_thread->quantum;
     }
     new_thread->strong_affinity = moe.system_affinity;
     if (name) {
         strncpy(&new_thread->name[0], name, THREAD_NAME_SIZE - 1);
     }
     if (start) {
-        const uintptr_t stack_count = 0x2000;
-        uintptr_t* stack = moe_alloc_object(stack_count * sizeof(uintptr_t), 1);
-        uintptr_t* sp = stack + stack_count;
+        new_thread->stack = stack;
+        new_thread->stack_size = stack_size;
+        uintptr_t* sp = (uintptr_t *)((uintptr_t)stack + stack_size);
         *--sp = 0;
         *--sp = 0x00007fffdeadbeef;
         io_setup_new_thread(&new_thread->context, sp, start, args);
     }
 
-    for (int i = 0; i< MAX_THREADS; i++) {
-        moe_thread_t *expected = NULL;
-        if (atomic_compare_exchange_weak(&moe.thread_list[i], &expected, new_thread))
-            break;
+    if (priority) {
+        uintptr_t flags = io_lock_irq();
+        sch_make_ready(_get_current_csd(), new_thread);
+        io_restore_irq(flags);
     }
 
-    sch_add(new_thread);
-
     return new_thread;
 }
 
@@ -328,22 +1006,25 @@ void thread_reschedule() {
     core_specific_data_t *csd = _get_current_csd();
     moe_thread_t *current = csd->current;
     moe_priority_level_t priority = current->priority;
+    sch_expire(csd);
     if (priority >= priority_realtime) {
         // do nothing
-    } else if (priority == priority_idle || (priority < priority_high && moe_queue_get_estimated_count(moe.ready[0]))) {
+    } else if (priority == priority_idle || (csd->ready_bitmap >> (sch_index(current) + 1))) {
+        // Preempted by a higher priority thread
         _next_thread(csd, current);
     } else {
         int quantum = atomic_fetch_add(&current->quantum_left, -1);
         if (quantum <= 1) {
-            atomic_fetch_add(&current->quantum_left, current->quantum);
+            current->quantum_left = current->quantum;
+            current->boosted = 0;
             _next_thread(csd, current);
         }
     }
 }
 
 
-int moe_create_thread(moe_thread_start start, moe_priority_level_t priority, void *args, const char *name) {
-    moe_thread_t *self = _create_thread(start, priority ? priority : priority_normal, args, name);
+int moe_create_thread_with_stack(moe_thread_start start, moe_priority_level_t priority, void *args, const char *name, size_t stack_size) {
+    moe_thread_t *self = _create_thread(start, priority ? priority : priority_normal, args, name, stack_size ? stack_size : MOE_DEFAULT_STACK_SIZE);
     if (self) {
         return self->thid;
     } else {
@@ -351,6 +1032,10 @@ int moe_create_thread(moe_thread_start start, moe_priority_level_t priority, voi
     }
 }
 
+int moe_create_thread(moe_thread_start start, moe_priority_level_t priority, void *args, const char *name) {
+    return moe_create_thread_with_stack(start, priority, args, name, MOE_DEFAULT_STACK_SIZE);
+}
+
 int moe_get_current_thread_id() {
     return _get_current_thread()->thid;
 }
@@ -359,6 +1044,21 @@ const char *moe_get_current_thread_name() {
     return _get_current_thread()->name;
 }
 
+// Restricts a thread to the CPUs in mask; 0 allows all CPUs again
+int moe_set_thread_affinity(int thid, uint32_t mask) {
+    moe_affinity_t affinity = mask ? (mask & moe.system_affinity) : moe.system_affinity;
+    if (!affinity) return -1;
+    moe_thread_t *thread = thread_get(thid);
+    if (!thread || !thread->priority || !moe_retain(&thread->shared)) return -1;
+    thread->strong_affinity = affinity;
+    thread_release(thread);
+    // Queued threads move when they are picked; the running one moves now
+    if (thread == _get_current_thread() && !(affinity & AFFINITY(smp_get_current_cpuid()))) {
+        moe_usleep(0);
+    }
+    return 0;
+}
+
 int moe_usleep(int64_t us) {
     if (moe.csd) {
         return moe_wait_for_object(NULL, us);
@@ -377,8 +1077,9 @@ _Noreturn void scheduler_thread(void *args) {
     for (;;) {
         moe_usleep(1000000);
         int64_t usage = 0;
-        for (int i = 0; i < MAX_THREADS; i++) {
-            moe_thread_t *thread = moe.thread_list[i];
+        int n_slots = atomic_load(&thread_table.n_slots);
+        for (int i = 0; i < n_slots; i++) {
+            moe_thread_t *thread = thread_get(i);
             if (!thread) continue;
             int load = atomic_load(&thread->load0);
             atomic_store(&thread->load, load);
@@ -387,6 +1088,21 @@ _Noreturn void scheduler_thread(void *args) {
                 usage += load;
             }
         }
+        for (int i = 0; i < moe.ncpu; i++) {
+            core_specific_data_t *csd = &moe.csd[i];
+            smp_tick_stat_t stat;
+            smp_get_tick_stat(i, &stat);
+            csd->irq_rate = stat.irqs - csd->irqs_last;
+            csd->irqs_last = stat.irqs;
+        }
+    }
+}
+
+
+_Noreturn void reaper_thread(void *args) {
+    for (;;) {
+        reap_zombies();
+        moe_usleep(REAPER_INTERVAL);
     }
 }
 
@@ -396,69 +1112,452 @@ void thread_init(int ncpu) {
 
     moe.ncpu = ncpu;
     moe.system_affinity = AFFINITY(ncpu) - 1;
-    moe.thread_list = moe_alloc_object(sizeof(void *), MAX_THREADS);
-    for (int i = 0; i < N_SCHEDULE_QUEUE; i++) {
-        moe.ready[i] = moe_queue_create(DEFAULT_SCHEDULE_SIZE);
-    }
-    moe.retired = moe_queue_create(DEFAULT_SCHEDULE_SIZE);
+    moe.thread_cache = moe_cache_create("moe_thread", sizeof(moe_thread_t), 64, NULL);
+    moe.fiber_cache = moe_cache_create("moe_fiber", sizeof(moe_fiber_t), 64, NULL);
+    moe_spinlock_register(&thread_table.lock, "thread_table");
+    moe_spinlock_register(&stack_pool.lock, "stack_pool");
+    moe_spinlock_register(&fiber_stack_pool.lock, "fiber_stack_pool");
     moe.next_pid = 1;
     moe.next_fibid = 1;
 
     core_specific_data_t *_csd = moe_alloc_object(sizeof(core_specific_data_t), ncpu);
     for (int i = 0; i < ncpu; i++) {
         _csd[i].cpuid = i;
+        _csd[i].mm = mm_init_cpu(i);
+        _csd[i].node = mm_node_of_cpu(i);
+        moe_spinlock_register(&_csd[i].rq_lock, "rq_lock");
         snprintf(name, THREAD_NAME_SIZE, "(Idle Core #%d)", i);
-        moe_thread_t *th = _create_thread(NULL, priority_idle, NULL, name);
+        moe_thread_t *th = _create_thread(NULL, priority_idle, NULL, name, 0);
         th->strong_affinity = th->weak_affinity = AFFINITY(i);
         _csd[i].idle = th;
         _csd[i].current = th;
     }
     moe.csd = _csd;
 
-    _create_thread(&scheduler_thread, priority_realtime, NULL, "scheduler");
+    _create_thread(&scheduler_thread, priority_realtime, NULL, "scheduler", MOE_DEFAULT_STACK_SIZE);
+    _create_thread(&reaper_thread, priority_low, NULL, "reaper", MOE_DEFAULT_STACK_SIZE);
 }
 
 int moe_get_number_of_active_cpus() {
     return moe.ncpu;
 }
 
+int moe_get_current_node() {
+    uintptr_t flags = io_lock_irq();
+    int node = _get_current_csd()->node;
+    io_restore_irq(flags);
+    return node;
+}
+
+// Per-CPU memory manager data; must be called with interrupts disabled
+void *moe_get_cpu_mm() {
+    if (!moe.csd) return NULL;
+    return _get_current_csd()->mm;
+}
+
 
 /*********************************************************************/
 // Spinlock
 
+// Ticket lock; the high half hands out tickets and the low half is the one being served
+#define SPINLOCK_TICKET     0x100000000ULL
+#define SPINLOCK_SERVING    0xFFFFFFFFULL
+#define LOCKSTAT_SIZE       128
+#define LOCKSTAT_TOP        16
+
+// Statistics of registered locks, gathered only while enabled
+typedef struct {
+    _Atomic (moe_spinlock_t *) lock;
+    const char *name;
+    _Atomic uintptr_t acquisitions, contended, spins;
+    _Atomic uint64_t max_hold;
+    uint64_t acquired_at;
+} lockstat_t;
+
+static struct {
+    _Atomic int enabled;
+    lockstat_t entries[LOCKSTAT_SIZE];
+} lockstat;
+
+static lockstat_t *lockstat_find(moe_spinlock_t *lock, int insert) {
+    uintptr_t hash = ((uintptr_t)lock >> 3) * 0x9E3779B97F4A7C15ULL >> 57;
+    for (int i = 0; i < LOCKSTAT_SIZE; i++) {
+        lockstat_t *entry = &lockstat.entries[(hash + i) % LOCKSTAT_SIZE];
+        moe_spinlock_t *p = atomic_load(&entry->lock);
+        if (p == lock) return entry;
+        if (!p) {
+            if (!insert) return NULL;
+            if (atomic_compare_exchange_strong(&entry->lock, &p, lock) || p == lock) return entry;
+        }
+    }
+    return NULL;
+}
+
+static void lockstat_acquired(moe_spinlock_t *lock, uintptr_t spins) {
+    lockstat_t *entry = lockstat_find(lock, 0);
+    if (!entry) return;
+    atomic_fetch_add(&entry->acquisitions, 1);
+    if (spins) {
+        atomic_fetch_add(&entry->contended, 1);
+        atomic_fetch_add(&entry->spins, spins);
+    }
+    entry->acquired_at = __builtin_ia32_rdtsc();
+}
+
+static void lockstat_released(moe_spinlock_t *lock) {
+    lockstat_t *entry = lockstat_find(lock, 0);
+    if (!entry || !entry->acquired_at) return;
+    uint64_t hold = __builtin_ia32_rdtsc() - entry->acquired_at;
+    entry->acquired_at = 0;
+    uint64_t max_hold = atomic_load(&entry->max_hold);
+    while (hold > max_hold && !atomic_compare_exchange_weak(&entry->max_hold, &max_hold, hold)) {
+        cpu_relax();
+    }
+}
+
+// Lets lockstat report the lock under name
+void moe_spinlock_register(moe_spinlock_t *lock, const char *name) {
+    lockstat_t *entry = lockstat_find(lock, 1);
+    if (entry) {
+        entry->name = name;
+    }
+}
+
 int moe_spinlock_try(moe_spinlock_t *lock) {
-    uintptr_t expected = 0;
-    uintptr_t desired = 1;
-    if (atomic_load(lock) != expected) return 0;
-    return atomic_compare_exchange_weak(lock, &expected, desired);
+    uintptr_t value = atomic_load(lock);
+    if ((value >> 32) != (value & SPINLOCK_SERVING)) return 0;
+    if (!atomic_compare_exchange_strong(lock, &value, value + SPINLOCK_TICKET)) return 0;
+    if (atomic_load_explicit(&lockstat.enabled, memory_order_relaxed)) {
+        lockstat_acquired(lock, 0);
+    }
+    return 1;
 }
 
+// Waiters are served in the order they arrive, each spinning on its own ticket
 int moe_spinlock_acquire(moe_spinlock_t *lock) {
-    for (;;) {
-        if (moe_spinlock_try(lock)) {
-            return 0;
+    uintptr_t ticket = atomic_fetch_add(lock, SPINLOCK_TICKET) >> 32;
+    uintptr_t spins = 0;
+    while ((atomic_load_explicit(lock, memory_order_acquire) & SPINLOCK_SERVING) != ticket) {
+        cpu_relax();
+        spins++;
+    }
+    if (atomic_load_explicit(&lockstat.enabled, memory_order_relaxed)) {
+        lockstat_acquired(lock, spins);
+    }
+    return 0;
+}
+
+void moe_spinlock_release(moe_spinlock_t *lock) {
+    if (atomic_load_explicit(&lockstat.enabled, memory_order_relaxed)) {
+        lockstat_released(lock);
+    }
+    // New tickets may be taken meanwhile, and the serving half must not carry into them
+    uintptr_t value = atomic_load(lock);
+    while (!atomic_compare_exchange_weak(lock, &value, (value & ~SPINLOCK_SERVING) | ((value + 1) & SPINLOCK_SERVING))) {
+        cpu_relax();
+    }
+}
+
+// Disables interrupts first, as a waiter interrupted by a handler taking the same lock would never be served
+uintptr_t moe_spinlock_acquire_irq(moe_spinlock_t *lock) {
+    uintptr_t flags = io_lock_irq();
+    moe_spinlock_acquire(lock);
+    return flags;
+}
+
+void moe_spinlock_release_irq(moe_spinlock_t *lock, uintptr_t flags) {
+    moe_spinlock_release(lock);
+    io_restore_irq(flags);
+}
+
+
+/*********************************************************************/
+// Fiber
+
+static fiber_sched_t *fiber_get_sched() {
+    return _get_current_thread()->fibers;
+}
+
+static moe_fiber_t *fiber_current() {
+    fiber_sched_t *sched = fiber_get_sched();
+    return sched ? sched->current : NULL;
+}
+
+static void fiber_ready(fiber_sched_t *sched, moe_fiber_t *fiber) {
+    fiber->next = NULL;
+    fiber->prev = sched->ready_tail;
+    if (sched->ready_tail) {
+        sched->ready_tail->next = fiber;
+    } else {
+        sched->ready_head = fiber;
+    }
+    sched->ready_tail = fiber;
+    fiber->queued = 1;
+}
+
+static void fiber_unready(fiber_sched_t *sched, moe_fiber_t *fiber) {
+    if (fiber->prev) {
+        fiber->prev->next = fiber->next;
+    } else {
+        sched->ready_head = fiber->next;
+    }
+    if (fiber->next) {
+        fiber->next->prev = fiber->prev;
+    } else {
+        sched->ready_tail = fiber->prev;
+    }
+    fiber->next = fiber->prev = NULL;
+    fiber->queued = 0;
+}
+
+static void fiber_timer_insert(fiber_sched_t *sched, moe_fiber_t *fiber) {
+    moe_fiber_t *prev = NULL, *next = sched->timer_head;
+    while (next && !timer_before(fiber->deadline, next->deadline)) {
+        prev = next;
+        next = next->timer_next;
+    }
+    fiber->timer_prev = prev;
+    fiber->timer_next = next;
+    if (prev) {
+        prev->timer_next = fiber;
+    } else {
+        sched->timer_head = fiber;
+    }
+    if (next) next->timer_prev = fiber;
+    fiber->timer_queued = 1;
+}
+
+static void fiber_timer_remove(fiber_sched_t *sched, moe_fiber_t *fiber) {
+    if (fiber->timer_prev) {
+        fiber->timer_prev->timer_next = fiber->timer_next;
+    } else {
+        sched->timer_head = fiber->timer_next;
+    }
+    if (fiber->timer_next) fiber->timer_next->timer_prev = fiber->timer_prev;
+    fiber->timer_next = fiber->timer_prev = NULL;
+    fiber->timer_queued = 0;
+}
+
+// Wakes a blocked fiber; may be called from any thread
+static void fiber_wake(moe_fiber_t *fiber) {
+    fiber_sched_t *sched = fiber->sched;
+    atomic_store(&fiber->permit, 1);
+    int expected = 1;
+    if (atomic_compare_exchange_strong(&fiber->blocked, &expected, 0)) {
+        uintptr_t flags = moe_spinlock_acquire_irq(&sched->lock);
+        fiber->next = NULL;
+        if (sched->woken_tail) {
+            sched->woken_tail->next = fiber;
         } else {
-            cpu_relax();
+            sched->woken_head = fiber;
         }
+        sched->woken_tail = fiber;
+        moe_spinlock_release_irq(&sched->lock, flags);
+        // Also when called from an IRQ on the owner itself, which may be about to park
+        thread_unpark(sched->thread);
     }
 }
 
-void moe_spinlock_release(moe_spinlock_t *lock) {
-    atomic_store(lock, 0);
+// Makes woken and expired fibers ready
+static void fiber_collect(fiber_sched_t *sched) {
+    moe_fiber_t *fiber = NULL;
+    if (sched->woken_head) {
+        uintptr_t flags = moe_spinlock_acquire_irq(&sched->lock);
+        fiber = sched->woken_head;
+        sched->woken_head = sched->woken_tail = NULL;
+        moe_spinlock_release_irq(&sched->lock, flags);
+    }
+    while (fiber) {
+        moe_fiber_t *next = fiber->next;
+        if (fiber->timer_queued) {
+            fiber_timer_remove(sched, fiber);
+        }
+        fiber_ready(sched, fiber);
+        fiber = next;
+    }
+    while (sched->timer_head && !moe_measure_until(sched->timer_head->deadline)) {
+        fiber = sched->timer_head;
+        fiber_timer_remove(sched, fiber);
+        // Otherwise fiber_wake has already put it on the woken list
+        int expected = 1;
+        if (atomic_compare_exchange_strong(&fiber->blocked, &expected, 0)) {
+            fiber_ready(sched, fiber);
+        }
+    }
+}
+
+static void fiber_switch_to(fiber_sched_t *sched, moe_fiber_t *next) {
+    moe_fiber_t *current = sched->current;
+    if (next == current) return;
+    sched->current = next;
+    sched->n_switches++;
+    _do_switch_fiber(&current->context, &next->context);
+}
+
+// Runs the next ready fiber, parking the thread while there is none
+static void fiber_schedule(fiber_sched_t *sched) {
+    for (;;) {
+        fiber_collect(sched);
+        moe_fiber_t *next = sched->ready_head;
+        if (next) {
+            fiber_unready(sched, next);
+            fiber_switch_to(sched, next);
+            return;
+        }
+        int64_t timeout = MOE_FOREVER;
+        if (sched->timer_head) {
+            timeout = MAX(-moe_measure_diff(sched->timer_head->deadline), 0);
+        }
+        thread_park(timeout);
+    }
+}
+
+// Blocks the current fiber until fiber_wake or timeout; returns 0 if woken, may return early
+static int fiber_block(fiber_sched_t *sched, int64_t us) {
+    moe_fiber_t *self = sched->current;
+    if (atomic_exchange(&self->permit, 0)) return 0;
+    if (us != MOE_FOREVER) {
+        self->deadline = moe_create_measure(us);
+        fiber_timer_insert(sched, self);
+    }
+    atomic_store(&self->blocked, 1);
+    // A wake between the exchange and blocking would be lost otherwise
+    int expected = 1;
+    if (atomic_load(&self->permit) && atomic_compare_exchange_strong(&self->blocked, &expected, 0)) {
+        if (self->timer_queued) {
+            fiber_timer_remove(sched, self);
+        }
+    } else {
+        fiber_schedule(sched);
+    }
+    return atomic_exchange(&self->permit, 0) ? 0 : -1;
+}
+
+moe_fiber_t *moe_create_fiber(moe_fiber_start start, void *args, size_t stack_size) {
+    moe_thread_t *thread = _get_current_thread();
+    fiber_sched_t *sched = thread->fibers;
+    if (!sched) {
+        sched = moe_alloc_object(sizeof(fiber_sched_t), 1);
+        if (!sched) return NULL;
+        sched->thread = thread;
+        sched->main.sched = sched;
+        sched->main.fibid = atomic_fetch_add(&moe.next_fibid, 1);
+        sched->current = &sched->main;
+        thread->fibers = sched;
+    }
+
+    stack_size = stack_size ? (stack_size + 0xFFF) & ~0xFFF : MOE_FIBER_STACK_SIZE;
+    void *stack = stack_alloc(stack_size, thread->node);
+    if (!stack) return NULL;
+    moe_fiber_t *fiber = moe_cache_alloc(moe.fiber_cache);
+    if (!fiber) {
+        stack_free(stack, stack_size);
+        return NULL;
+    }
+    fiber->sched = sched;
+    fiber->fibid = atomic_fetch_add(&moe.next_fibid, 1);
+    fiber->stack = stack;
+    fiber->stack_size = stack_size;
+    // Leave the home space of the entry point above the initial frame
+    uintptr_t* sp = (uintptr_t *)((uintptr_t)stack + stack_size - 0x20);
+    io_setup_new_fiber(&fiber->context, sp, start, args);
+    sched->n_fibers++;
+    fiber_ready(sched, fiber);
+    return fiber;
+}
+
+void moe_yield_fiber() {
+    fiber_sched_t *sched = fiber_get_sched();
+    if (!sched) return;
+    fiber_collect(sched);
+    moe_fiber_t *next = sched->ready_head;
+    if (!next) return;
+    fiber_unready(sched, next);
+    fiber_ready(sched, sched->current);
+    fiber_switch_to(sched, next);
+}
+
+// Runs a ready fiber of the current thread right away
+int moe_switch_fiber(moe_fiber_t *fiber) {
+    fiber_sched_t *sched = fiber_get_sched();
+    if (!sched || fiber->sched != sched) return -1;
+    if (fiber == sched->current) return 0;
+    fiber_collect(sched);
+    if (!fiber->queued) return -1;
+    fiber_unready(sched, fiber);
+    fiber_ready(sched, sched->current);
+    fiber_switch_to(sched, fiber);
+    return 0;
+}
+
+int moe_sleep_fiber(int64_t us) {
+    fiber_sched_t *sched = fiber_get_sched();
+    if (!sched) return moe_usleep(us);
+    moe_measure_t deadline = moe_create_measure(us);
+    while (moe_measure_until(deadline)) {
+        fiber_block(sched, -moe_measure_diff(deadline));
+    }
+    return 0;
+}
+
+int moe_join_fiber(moe_fiber_t *fiber, int *exit_code) {
+    fiber_sched_t *sched = fiber_get_sched();
+    if (!sched || fiber->sched != sched || fiber == sched->current || fiber == &sched->main || fiber->joiner) return -1;
+    while (!fiber->dead) {
+        fiber->joiner = sched->current;
+        fiber_block(sched, MOE_FOREVER);
+    }
+    // A dead fiber never runs again, so its stack is no longer in use
+    if (exit_code) *exit_code = fiber->exit_code;
+    stack_free(fiber->stack, fiber->stack_size);
+    moe_cache_free(moe.fiber_cache, fiber);
+    sched->n_fibers--;
+    return 0;
+}
+
+_Noreturn void moe_exit_fiber(int exit_code) {
+    fiber_sched_t *sched = fiber_get_sched();
+    if (!sched || sched->current == &sched->main) {
+        moe_exit_thread(exit_code);
+    }
+    moe_fiber_t *self = sched->current;
+    self->exit_code = exit_code;
+    self->dead = 1;
+    if (self->joiner) {
+        fiber_wake(self->joiner);
+    }
+    for (;;) fiber_schedule(sched);
+}
+
+int moe_get_current_fiber_id() {
+    moe_fiber_t *fiber = fiber_current();
+    return fiber ? fiber->fibid : 0;
 }
 
 
 /*********************************************************************/
 // Semaphore
 
+// Waiters queue up in FIFO order and a signal hands its unit directly to the first one
+typedef struct moe_sem_waiter_t {
+    struct moe_sem_waiter_t *next;
+    moe_thread_t *thread;
+    moe_fiber_t *fiber;
+    _Atomic int granted;
+} moe_sem_waiter_t;
+
 typedef struct moe_semaphore_t {
-    moe_thread_t * _Atomic thread;
     _Atomic intptr_t value;
+    _Atomic int n_waiters;
+    moe_spinlock_t lock;
+    moe_sem_waiter_t *head, *tail;
 } moe_semaphore_t;
 
 void moe_sem_init(moe_semaphore_t *self, intptr_t value) {
-    self->thread = NULL;
     self->value = value;
+    self->n_waiters = 0;
+    self->lock = 0;
+    self->head = self->tail = NULL;
 }
 
 moe_semaphore_t *moe_sem_create(intptr_t value) {
@@ -485,6 +1584,40 @@ int moe_sem_trywait(moe_semaphore_t *self) {
     return -1;
 }
 
+static void sem_remove_waiter(moe_semaphore_t *self, moe_sem_waiter_t *waiter) {
+    moe_sem_waiter_t **p = &self->head, *prev = NULL;
+    while (*p && *p != waiter) {
+        prev = *p;
+        p = &(*p)->next;
+    }
+    if (*p) {
+        *p = waiter->next;
+        if (self->tail == waiter) self->tail = prev;
+    }
+}
+
+// Gives a unit to the first waiter; must be called with the lock held, and the caller
+// must pass the waiter to sem_wake after releasing the lock
+static moe_sem_waiter_t *sem_grant(moe_semaphore_t *self) {
+    moe_sem_waiter_t *waiter = self->head;
+    self->head = waiter->next;
+    if (!self->head) self->tail = NULL;
+    atomic_fetch_add(&self->n_waiters, -1);
+    atomic_store(&waiter->granted, 1);
+    return waiter;
+}
+
+// The waiter may return and take the semaphore with it once granted is 2,
+// so that store is the last access to either of them
+static void sem_wake(moe_sem_waiter_t *waiter) {
+    if (waiter->fiber) {
+        fiber_wake(waiter->fiber);
+    } else {
+        thread_unpark(waiter->thread);
+    }
+    atomic_store(&waiter->granted, 2);
+}
+
 int moe_sem_wait(moe_semaphore_t *self, int64_t us) {
 
     if (!moe_sem_trywait(self)) {
@@ -492,74 +1625,195 @@ int moe_sem_wait(moe_semaphore_t *self, int64_t us) {
     }
 
     moe_measure_t deadline = moe_create_measure(us);
-    const int64_t timeout_min = 100;
-    const int64_t timeout_max = 1000000;
-    int64_t timeout = timeout_min;
-    moe_thread_t *current = _get_current_thread();
-    do {
-        moe_thread_t *expected = NULL;
-        if (atomic_compare_exchange_weak(&self->thread, &expected, current)) {
-            timeout = timeout_min;
-            while (moe_measure_until(deadline)) {
-                moe_wait_for_object(&self->thread, timeout);
-                if (!moe_sem_trywait(self)) {
-                    return 0;
-                }
-                timeout = MIN(timeout_max, timeout * 2);
-            }
-            return -1;
+    // Threads running fibers only block the current fiber
+    moe_sem_waiter_t waiter = { NULL, _get_current_thread(), fiber_current(), 0 };
+
+    uintptr_t flags = moe_spinlock_acquire_irq(&self->lock);
+    // Signalers look at n_waiters after raising the value, so check the value again after raising it
+    atomic_fetch_add(&self->n_waiters, 1);
+    if (!moe_sem_trywait(self)) {
+        atomic_fetch_add(&self->n_waiters, -1);
+        moe_spinlock_release_irq(&self->lock, flags);
+        return 0;
+    }
+    if (self->tail) {
+        self->tail->next = &waiter;
+    } else {
+        self->head = &waiter;
+    }
+    self->tail = &waiter;
+    moe_spinlock_release_irq(&self->lock, flags);
+
+    while (!atomic_load(&waiter.granted)) {
+        int64_t timeout = MOE_FOREVER;
+        if (us != MOE_FOREVER) {
+            timeout = -moe_measure_diff(deadline);
+            if (timeout <= 0) break;
+        }
+        if (waiter.fiber) {
+            fiber_block(waiter.fiber->sched, timeout);
+        } else {
+            thread_park(timeout);
         }
-        moe_usleep(timeout);
-        timeout = MIN(timeout_max, timeout * 2);
-    } while (moe_measure_until(deadline));
+    }
+    if (atomic_load(&waiter.granted)) {
+        while (atomic_load(&waiter.granted) != 2) {
+            cpu_relax();
+        }
+        return 0;
+    }
 
+    flags = moe_spinlock_acquire_irq(&self->lock);
+    int granted = atomic_load(&waiter.granted);
+    if (!granted) {
+        sem_remove_waiter(self, &waiter);
+        atomic_fetch_add(&self->n_waiters, -1);
+    }
+    moe_spinlock_release_irq(&self->lock, flags);
+    if (granted) {
+        // Granted just before the timeout; the signaler is still waking us up
+        while (atomic_load(&waiter.granted) != 2) {
+            cpu_relax();
+        }
+        return 0;
+    }
     return -1;
 }
 
 void moe_sem_signal(moe_semaphore_t *self) {
-    moe_thread_t *thread = atomic_load(&self->thread);
-    atomic_fetch_add(&self->value, 1);
-    if (thread) {
-        moe_signal_object(&self->thread);
-        atomic_compare_exchange_weak(&self->thread, &thread, NULL);
+    if (!atomic_load(&self->n_waiters)) {
+        atomic_fetch_add(&self->value, 1);
+        if (!atomic_load(&self->n_waiters)) return;
+        // A waiter came in meanwhile; pass the unit on if nobody has taken it
+        moe_sem_waiter_t *waiter = NULL;
+        uintptr_t flags = moe_spinlock_acquire_irq(&self->lock);
+        if (self->head && !moe_sem_trywait(self)) {
+            waiter = sem_grant(self);
+        }
+        moe_spinlock_release(&self->lock);
+        if (waiter) {
+            sem_wake(waiter);
+        }
+        io_restore_irq(flags);
+        return;
+    }
+
+    // Interrupts stay off until the wakeup is done, as the waiter spins for it
+    moe_sem_waiter_t *waiter = NULL;
+    uintptr_t flags = moe_spinlock_acquire_irq(&self->lock);
+    if (self->head) {
+        waiter = sem_grant(self);
+    } else {
+        atomic_fetch_add(&self->value, 1);
+    }
+    moe_spinlock_release(&self->lock);
+    if (waiter) {
+        sem_wake(waiter);
     }
+    io_restore_irq(flags);
 }
 
 
 /*********************************************************************/
 // Queue
 
+#define QUEUE_CACHE_LINE    64
+
+// Bounded ring after Vyukov; each cell's seq tells whose turn it is:
+// pos when it is free for the producer at pos, pos + 1 once the data is in
+typedef struct {
+    _Atomic uintptr_t seq;
+    _Atomic intptr_t data;
+} queue_cell_t;
+
 typedef struct moe_queue_t {
     moe_semaphore_t read_sem;
-    _Atomic uint32_t read, write, free;
     uint32_t mask;
+    int flags;
+    // Producers and consumers each get their own cache line
+    _Alignas(QUEUE_CACHE_LINE) _Atomic uintptr_t tail;
+    _Alignas(QUEUE_CACHE_LINE) _Atomic uintptr_t head;
+    _Alignas(QUEUE_CACHE_LINE) queue_cell_t cells[];
 } moe_queue_t;
 
 
-moe_queue_t *moe_queue_create(size_t capacity) {
-    moe_queue_t *self = moe_alloc_object(sizeof(moe_queue_t) + sizeof(uintptr_t) * capacity, 1);
+moe_queue_t *moe_queue_create_with_flags(size_t capacity, int flags) {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+    moe_queue_t *self = moe_alloc_object(sizeof(moe_queue_t) + sizeof(queue_cell_t) * size, 1);
+    if (!self) return NULL;
     moe_sem_init(&self->read_sem, 0);
-    self->read = 0;
-    self->write = 0;
-    self->free = capacity - 1;
-    self->mask = capacity - 1;
+    self->mask = size - 1;
+    self->flags = flags;
+    self->head = 0;
+    self->tail = 0;
+    for (uintptr_t i = 0; i < size; i++) {
+        atomic_store_explicit(&self->cells[i].seq, i, memory_order_relaxed);
+    }
     return self;
 }
 
-static _Atomic intptr_t *_queue_get_data_ptr(moe_queue_t *self) {
-    return (void *)((intptr_t)self + sizeof(moe_queue_t));
+moe_queue_t *moe_queue_create(size_t capacity) {
+    return moe_queue_create_with_flags(capacity, 0);
 }
 
-static intptr_t queue_read_main(moe_queue_t* self) {
-    uintptr_t read_ptr = atomic_fetch_add(&self->read, 1);
-    intptr_t retval = atomic_load(_queue_get_data_ptr(self) + (read_ptr & self->mask));
-    atomic_fetch_add(&self->free, 1);
-    return retval;
+static int queue_enqueue(moe_queue_t *self, intptr_t data) {
+    uintptr_t pos = atomic_load_explicit(&self->tail, memory_order_relaxed);
+    queue_cell_t *cell;
+    if (self->flags & MOE_QUEUE_SINGLE_PRODUCER) {
+        cell = &self->cells[pos & self->mask];
+        if (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos) return -1;
+        atomic_store_explicit(&self->tail, pos + 1, memory_order_relaxed);
+    } else {
+        for (;;) {
+            cell = &self->cells[pos & self->mask];
+            intptr_t diff = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)pos;
+            if (diff == 0) {
+                if (atomic_compare_exchange_weak_explicit(&self->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return -1;
+            } else {
+                pos = atomic_load_explicit(&self->tail, memory_order_relaxed);
+            }
+        }
+    }
+    atomic_store_explicit(&cell->data, data, memory_order_relaxed);
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+// The caller owns an item through read_sem, so the head cell is being filled if not full yet
+static intptr_t queue_dequeue(moe_queue_t *self) {
+    uintptr_t pos = atomic_load_explicit(&self->head, memory_order_relaxed);
+    queue_cell_t *cell;
+    if (self->flags & MOE_QUEUE_SINGLE_CONSUMER) {
+        cell = &self->cells[pos & self->mask];
+        while (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + 1) {
+            cpu_relax();
+        }
+        atomic_store_explicit(&self->head, pos + 1, memory_order_relaxed);
+    } else {
+        for (;;) {
+            cell = &self->cells[pos & self->mask];
+            intptr_t diff = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (atomic_compare_exchange_weak_explicit(&self->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                cpu_relax();
+                pos = atomic_load_explicit(&self->head, memory_order_relaxed);
+            } else {
+                pos = atomic_load_explicit(&self->head, memory_order_relaxed);
+            }
+        }
+    }
+    intptr_t data = atomic_load_explicit(&cell->data, memory_order_relaxed);
+    atomic_store_explicit(&cell->seq, pos + self->mask + 1, memory_order_release);
+    return data;
 }
 
 intptr_t moe_queue_read(moe_queue_t* self, intptr_t default_val) {
     if (!moe_sem_trywait(&self->read_sem)) {
-        return queue_read_main(self);
+        return queue_dequeue(self);
     } else {
         return default_val;
     }
@@ -567,7 +1821,7 @@ intptr_t moe_queue_read(moe_queue_t* self, intptr_t default_val) {
 
 int moe_queue_wait(moe_queue_t* self, intptr_t* result, uint64_t us) {
     if (!moe_sem_wait(&self->read_sem, us)) {
-        *result = queue_read_main(self);
+        *result = queue_dequeue(self);
         return 1;
     } else {
         return 0;
@@ -575,18 +1829,14 @@ int moe_queue_wait(moe_queue_t* self, intptr_t* result, uint64_t us) {
 }
 
 int moe_queue_write(moe_queue_t* self, intptr_t data) {
-    uint32_t free = atomic_load(&self->free);
-    while (free > 0) {
-        if (atomic_compare_exchange_weak(&self->free, &free, free - 1)) {
-            uintptr_t write_ptr = atomic_fetch_add(&self->write, 1);
-            atomic_store(_queue_get_data_ptr(self) + (write_ptr & self->mask), data);
-            moe_sem_signal(&self->read_sem);
-            return 0;
-        } else {
-            cpu_relax();
-        }
+    // Claiming a cell and filling it must not be preempted, as readers may be spinning on it
+    uintptr_t flags = io_lock_irq();
+    int retval = queue_enqueue(self, data);
+    io_restore_irq(flags);
+    if (!retval) {
+        moe_sem_signal(&self->read_sem);
     }
-    return -1;
+    return retval;
 }
 
 size_t moe_queue_get_estimated_count(moe_queue_t* self) {
@@ -595,7 +1845,8 @@ size_t moe_queue_get_estimated_count(moe_queue_t* self) {
 }
 
 size_t moe_queue_get_estimated_free(moe_queue_t* self) {
-    return atomic_load(&self->free);
+    intptr_t used = atomic_load(&self->tail) - atomic_load(&self->head);
+    return self->mask + 1 - MIN(MAX(used, 0), (intptr_t)self->mask + 1);
 }
 
 
@@ -645,9 +1896,10 @@ int moe_create_process(moe_thread_start start, moe_priority_level_t priority, vo
 
 
 int cmd_ps(int argc, char **argv) {
-    printf("THID PID attr affinity usage cpu time    name\n");
-    for (int i = 0; i < MAX_THREADS; i++) {
-        moe_thread_t* p = moe.thread_list[i];
+    printf("THID PID attr affinity usage cpu time     migr name\n");
+    int n_slots = atomic_load(&thread_table.n_slots);
+    for (int i = 0; i < n_slots; i++) {
+        moe_thread_t* p = thread_get(i);
         if (!p) continue;
         if (moe_retain(&p->shared)) {
             uint64_t cputime = p->cputime;
@@ -659,12 +1911,455 @@ int cmd_ps(int argc, char **argv) {
             int usage = p->load / 1000;
             if (usage > 999) usage = 999;
             int usage0 = usage % 10, usage1 = usage / 10;
-            printf("%4u %3u %04zx %08x %2u.%u%% %2u:%02u:%02u.%02u %s\n",
+            printf("%4u %3u %04zx %08x %2u.%u%% %2u:%02u:%02u.%02u %5u %s\n",
                 (int)p->thid, (int)p->pid, p->flags,
                 p->strong_affinity, usage1, usage0, time_h, time_m, time_s, time_ms,
-                p->name);
+                p->n_migrations, p->name);
             thread_release(p);
         }
     }
+    printf("threads: %d, table slots %d\n", (int)thread_table.n_threads, n_slots);
+    printf("stacks: %d pooled, hit/miss %zu/%zu, %zu threads reaped\n",
+        stack_pool.count, (size_t)stack_pool.hits, (size_t)stack_pool.misses, (size_t)reaper.reaped);
+    for (int i = 0; i < moe.ncpu; i++) {
+        core_specific_data_t *csd = &moe.csd[i];
+        printf("cpu%d: node %d, ready %zu (%02x), timers %d, switches %zu, steals %zu, aged %zu\n",
+            i, csd->node, sch_ready_count(csd), csd->ready_bitmap, csd->n_timers,
+            (size_t)csd->n_switches, (size_t)csd->n_steals, (size_t)csd->n_aged);
+        smp_tick_stat_t stat;
+        smp_get_tick_stat(i, &stat);
+        printf("      %zu irq/s, ipis %zu, ticks avoided %zu", csd->irq_rate, stat.wakeups, stat.ticks_avoided);
+        if (smp_is_tickless()) {
+            printf(", idle timers %zu", stat.idle_timers);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+// lockstat [on|off|reset]: lists the most contended registered locks
+int cmd_lockstat(int argc, char **argv) {
+    if (argc > 1) {
+        if (!strncmp(argv[1], "on", 3)) {
+            atomic_store(&lockstat.enabled, 1);
+        } else if (!strncmp(argv[1], "off", 4)) {
+            atomic_store(&lockstat.enabled, 0);
+        } else if (!strncmp(argv[1], "reset", 6)) {
+            for (int i = 0; i < LOCKSTAT_SIZE; i++) {
+                lockstat_t *entry = &lockstat.entries[i];
+                entry->acquisitions = 0;
+                entry->contended = 0;
+                entry->spins = 0;
+                entry->max_hold = 0;
+            }
+        } else {
+            printf("usage: lockstat [on|off|reset]\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    // Selection by contended acquisitions, then by acquisitions
+    uint8_t listed[LOCKSTAT_SIZE];
+    memset(listed, 0, sizeof(listed));
+    printf("statistics %s\n", lockstat.enabled ? "enabled" : "disabled");
+    printf("    acquired    contended        spins  max hold(tsc) name\n");
+    for (int n = 0; n < LOCKSTAT_TOP; n++) {
+        int best = -1;
+        for (int i = 0; i < LOCKSTAT_SIZE; i++) {
+            lockstat_t *entry = &lockstat.entries[i];
+            if (listed[i] || !entry->lock || !entry->acquisitions) continue;
+            if (best < 0 || entry->contended > lockstat.entries[best].contended
+                || (entry->contended == lockstat.entries[best].contended
+                    && entry->acquisitions > lockstat.entries[best].acquisitions)) {
+                best = i;
+            }
+        }
+        if (best < 0) break;
+        listed[best] = 1;
+        lockstat_t *entry = &lockstat.entries[best];
+        printf("%12zu %12zu %12zu %14llu %s (%p)\n",
+            (size_t)entry->acquisitions, (size_t)entry->contended, (size_t)entry->spins,
+            (uint64_t)entry->max_hold, entry->name ? entry->name : "?", (void *)entry->lock);
+    }
+    return 0;
+}
+
+// pin THID [CPU]: binds a thread to a CPU, or lets it run anywhere again
+int cmd_pin(int argc, char **argv) {
+    if (argc < 2) {
+        printf("usage: pin THID [CPU]\n");
+        return 1;
+    }
+    int thid = atoi(argv[1]);
+    uint32_t mask = 0;
+    if (argc > 2) {
+        int cpu = atoi(argv[2]);
+        if (cpu < 0 || cpu >= moe.ncpu) {
+            printf("pin: no such cpu %d\n", cpu);
+            return 1;
+        }
+        mask = AFFINITY(cpu);
+    }
+    if (moe_set_thread_affinity(thid, mask)) {
+        printf("pin: no such thread %d\n", thid);
+        return 1;
+    }
+    return 0;
+}
+
+
+#define CSBENCH_TIME    1000000
+#define CSBENCH_MAX_THREADS 32
+
+typedef struct {
+    _Atomic int ready, done, go;
+    _Atomic uint64_t n_yields;
+} csbench_t;
+
+static void csbench_thread(void *args) {
+    csbench_t *bench = args;
+    atomic_fetch_add(&bench->ready, 1);
+    while (!bench->go) {
+        moe_usleep(1000);
+    }
+    uint64_t n_yields = 0;
+    moe_measure_t deadline = moe_create_measure(CSBENCH_TIME);
+    while (moe_measure_until(deadline)) {
+        moe_usleep(0);
+        n_yields++;
+    }
+    atomic_fetch_add(&bench->n_yields, n_yields);
+    atomic_fetch_add(&bench->done, 1);
+}
+
+// Context switch benchmark: yielding threads scaled over the cores
+int cmd_csbench(int argc, char **argv) {
+    int max_threads = MIN(moe.ncpu, CSBENCH_MAX_THREADS);
+    if (argc > 1) {
+        max_threads = MAX(MIN(atoi(argv[1]), CSBENCH_MAX_THREADS), 1);
+    }
+
+    printf("threads   yields/sec switches/sec   steals\n");
+    for (int n_threads = 1; n_threads; n_threads = bench_next_threads(n_threads, max_threads)) {
+        csbench_t bench;
+        memset(&bench, 0, sizeof(bench));
+        for (int i = 0; i < n_threads; i++) {
+            moe_create_thread(&csbench_thread, 0, &bench, "csbench");
+        }
+        while (bench.ready < n_threads) {
+            moe_usleep(1000);
+        }
+        uint64_t switches = 0, steals = 0;
+        for (int i = 0; i < moe.ncpu; i++) {
+            switches -= moe.csd[i].n_switches;
+            steals -= moe.csd[i].n_steals;
+        }
+        moe_measure_t measure = moe_create_measure(0);
+        bench.go = 1;
+        while (bench.done < n_threads) {
+            moe_usleep(1000);
+        }
+        int64_t elapsed = MAX(moe_measure_diff(measure), 1);
+        for (int i = 0; i < moe.ncpu; i++) {
+            switches += moe.csd[i].n_switches;
+            steals += moe.csd[i].n_steals;
+        }
+
+        printf("%7d %12lld %12lld %8lld\n", n_threads,
+            (int64_t)bench.n_yields * 1000000 / elapsed, (int64_t)switches * 1000000 / elapsed, (int64_t)steals);
+    }
+    return 0;
+}
+
+
+#define SEMBENCH_ROUNDS     10000
+#define SEMBENCH_ITEMS      20000
+#define SEMBENCH_QUEUE_SIZE 64
+#define SEMBENCH_STOP       (-1)
+
+typedef struct {
+    moe_semaphore_t *ping, *pong;
+    moe_queue_t *queue;
+    int n_items;
+    _Atomic int done, consumed;
+    _Atomic int64_t latency;
+} sembench_t;
+
+static void sembench_pong(void *args) {
+    sembench_t *bench = args;
+    for (int i = 0; i < SEMBENCH_ROUNDS; i++) {
+        moe_sem_wait(bench->ping, MOE_FOREVER);
+        moe_sem_signal(bench->pong);
+    }
+    atomic_fetch_add(&bench->done, 1);
+}
+
+static void sembench_producer(void *args) {
+    sembench_t *bench = args;
+    for (int i = 0; i < bench->n_items; i++) {
+        while (moe_queue_write(bench->queue, moe_create_measure(0))) {
+            moe_usleep(0);
+        }
+    }
+    atomic_fetch_add(&bench->done, 1);
+}
+
+static void sembench_consumer(void *args) {
+    sembench_t *bench = args;
+    intptr_t item;
+    while (moe_queue_wait(bench->queue, &item, MOE_FOREVER) && item != SEMBENCH_STOP) {
+        atomic_fetch_add(&bench->latency, moe_measure_diff(item));
+        atomic_fetch_add(&bench->consumed, 1);
+    }
+    atomic_fetch_add(&bench->done, 1);
+}
+
+static void sembench_wait_done(sembench_t *bench, int count) {
+    while (bench->done < count) {
+        moe_usleep(1000);
+    }
+}
+
+// Semaphore benchmark: ping-pong round trips and producer/consumer queue latency
+int cmd_sembench(int argc, char **argv) {
+    sembench_t bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.ping = moe_sem_create(0);
+    bench.pong = moe_sem_create(0);
+    moe_create_thread(&sembench_pong, 0, &bench, "sembench");
+    moe_measure_t measure = moe_create_measure(0);
+    for (int i = 0; i < SEMBENCH_ROUNDS; i++) {
+        moe_sem_signal(bench.ping);
+        moe_sem_wait(bench.pong, MOE_FOREVER);
+    }
+    int64_t elapsed = MAX(moe_measure_diff(measure), 1);
+    sembench_wait_done(&bench, 1);
+    moe_free_object(bench.ping);
+    moe_free_object(bench.pong);
+    printf("ping-pong: %lld ns/round trip\n", elapsed * 1000 / SEMBENCH_ROUNDS);
+
+    static const int configs[][2] = { {1, 1}, {1, 4}, {4, 1}, {4, 4}, {8, 8} };
+    printf("prod cons    items/sec latency(us)\n");
+    for (int i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        int n_producers = configs[i][0], n_consumers = configs[i][1];
+        memset(&bench, 0, sizeof(bench));
+        bench.queue = moe_queue_create(SEMBENCH_QUEUE_SIZE);
+        bench.n_items = SEMBENCH_ITEMS / n_producers;
+        for (int j = 0; j < n_consumers; j++) {
+            moe_create_thread(&sembench_consumer, 0, &bench, "sembench");
+        }
+        measure = moe_create_measure(0);
+        for (int j = 0; j < n_producers; j++) {
+            moe_create_thread(&sembench_producer, 0, &bench, "sembench");
+        }
+        sembench_wait_done(&bench, n_producers);
+        while (moe_queue_get_estimated_count(bench.queue)) {
+            moe_usleep(1000);
+        }
+        elapsed = MAX(moe_measure_diff(measure), 1);
+        for (int j = 0; j < n_consumers; j++) {
+            while (moe_queue_write(bench.queue, SEMBENCH_STOP)) {
+                moe_usleep(1000);
+            }
+        }
+        sembench_wait_done(&bench, n_producers + n_consumers);
+        moe_free_object(bench.queue);
+
+        int consumed = MAX(bench.consumed, 1);
+        printf("%4d %4d %12lld %11lld\n", n_producers, n_consumers,
+            (int64_t)bench.consumed * 1000000 / elapsed, bench.latency / consumed);
+    }
+    return 0;
+}
+
+
+#define QBENCH_ITEMS        100000
+#define QBENCH_QUEUE_SIZE   256
+
+// Queue benchmark: throughput and latency of each queue flavour over the cores
+int cmd_qbench(int argc, char **argv) {
+    static const struct {
+        const char *name;
+        int flags, n_producers, n_consumers;
+    } configs[] = {
+        { "spsc", MOE_QUEUE_SINGLE_PRODUCER | MOE_QUEUE_SINGLE_CONSUMER, 1, 1 },
+        { "mpsc", MOE_QUEUE_SINGLE_CONSUMER, 1, 1 },
+        { "mpsc", MOE_QUEUE_SINGLE_CONSUMER, 4, 1 },
+        { "mpmc", 0, 1, 1 },
+        { "mpmc", 0, 4, 1 },
+        { "mpmc", 0, 4, 4 },
+        { "mpmc", 0, 8, 8 },
+    };
+    printf("kind prod cons    items/sec latency(us)\n");
+    for (int i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        int n_producers = configs[i].n_producers, n_consumers = configs[i].n_consumers;
+        sembench_t bench;
+        memset(&bench, 0, sizeof(bench));
+        bench.queue = moe_queue_create_with_flags(QBENCH_QUEUE_SIZE, configs[i].flags);
+        if (!bench.queue) return 1;
+        bench.n_items = QBENCH_ITEMS / n_producers;
+        for (int j = 0; j < n_consumers; j++) {
+            moe_create_thread(&sembench_consumer, 0, &bench, "qbench");
+        }
+        moe_measure_t measure = moe_create_measure(0);
+        for (int j = 0; j < n_producers; j++) {
+            moe_create_thread(&sembench_producer, 0, &bench, "qbench");
+        }
+        sembench_wait_done(&bench, n_producers);
+        while (moe_queue_get_estimated_count(bench.queue)) {
+            moe_usleep(1000);
+        }
+        int64_t elapsed = MAX(moe_measure_diff(measure), 1);
+        for (int j = 0; j < n_consumers; j++) {
+            while (moe_queue_write(bench.queue, SEMBENCH_STOP)) {
+                moe_usleep(1000);
+            }
+        }
+        sembench_wait_done(&bench, n_producers + n_consumers);
+        moe_free_object(bench.queue);
+
+        int consumed = MAX(bench.consumed, 1);
+        printf("%s %4d %4d %12lld %11lld\n", configs[i].name, n_producers, n_consumers,
+            (int64_t)bench.consumed * 1000000 / elapsed, bench.latency / consumed);
+    }
+    return 0;
+}
+
+
+#define FIBENCH_ROUNDS      10000
+#define FIBENCH_SPAWNS      1000
+#define FIBENCH_THREADS     100
+#define FIBENCH_YIELDS      100
+
+typedef struct {
+    moe_semaphore_t *ping, *pong, *done;
+    int n_fibers;
+    int64_t fiber_create, thread_create, fiber_yield, fiber_sem, thread_sem, fiber_mass;
+} fibench_t;
+
+static int fibench_nop(void *args) {
+    return 0;
+}
+
+static int fibench_yielder(void *args) {
+    int n = (intptr_t)args;
+    for (int i = 0; i < n; i++) {
+        moe_yield_fiber();
+    }
+    return 0;
+}
+
+static int fibench_fiber_pong(void *args) {
+    fibench_t *bench = args;
+    for (int i = 0; i < FIBENCH_ROUNDS; i++) {
+        moe_sem_wait(bench->ping, MOE_FOREVER);
+        moe_sem_signal(bench->pong);
+    }
+    return 0;
+}
+
+static void fibench_thread_pong(void *args) {
+    fibench_t *bench = args;
+    for (int i = 0; i < FIBENCH_ROUNDS; i++) {
+        moe_sem_wait(bench->ping, MOE_FOREVER);
+        moe_sem_signal(bench->pong);
+    }
+    moe_sem_signal(bench->done);
+}
+
+static void fibench_thread_nop(void *args) {
+    fibench_t *bench = args;
+    moe_sem_signal(bench->done);
+}
+
+static moe_fiber_t *fibench_fibers[FIBENCH_SPAWNS];
+
+// Runs the fiber part in a thread of its own, so the shell thread never gets fibers
+static void fibench_fiber_thread(void *args) {
+    fibench_t *bench = args;
+
+    moe_measure_t measure = moe_create_measure(0);
+    for (int i = 0; i < FIBENCH_SPAWNS; i++) {
+        fibench_fibers[i] = moe_create_fiber(&fibench_nop, NULL, 0);
+    }
+    for (int i = 0; i < FIBENCH_SPAWNS; i++) {
+        if (fibench_fibers[i]) moe_join_fiber(fibench_fibers[i], NULL);
+    }
+    bench->fiber_create = moe_measure_diff(measure) * 1000 / FIBENCH_SPAWNS;
+
+    moe_fiber_t *fiber = moe_create_fiber(&fibench_yielder, (void *)FIBENCH_ROUNDS, 0);
+    measure = moe_create_measure(0);
+    for (int i = 0; i < FIBENCH_ROUNDS; i++) {
+        moe_yield_fiber();
+    }
+    bench->fiber_yield = moe_measure_diff(measure) * 1000 / (FIBENCH_ROUNDS * 2);
+    moe_join_fiber(fiber, NULL);
+
+    fiber = moe_create_fiber(&fibench_fiber_pong, bench, 0);
+    measure = moe_create_measure(0);
+    for (int i = 0; i < FIBENCH_ROUNDS; i++) {
+        moe_sem_signal(bench->ping);
+        moe_sem_wait(bench->pong, MOE_FOREVER);
+    }
+    bench->fiber_sem = moe_measure_diff(measure) * 1000 / FIBENCH_ROUNDS;
+    moe_join_fiber(fiber, NULL);
+
+    moe_fiber_t **fibers = moe_alloc_object(sizeof(moe_fiber_t *), bench->n_fibers);
+    if (fibers) {
+        for (int i = 0; i < bench->n_fibers; i++) {
+            fibers[i] = moe_create_fiber(&fibench_yielder, (void *)FIBENCH_YIELDS, 0);
+        }
+        measure = moe_create_measure(0);
+        for (int i = 0; i < bench->n_fibers; i++) {
+            if (fibers[i]) moe_join_fiber(fibers[i], NULL);
+        }
+        int64_t elapsed = MAX(moe_measure_diff(measure), 1);
+        bench->fiber_mass = (int64_t)bench->n_fibers * FIBENCH_YIELDS * 1000000 / elapsed;
+        moe_free_object(fibers);
+    }
+
+    moe_sem_signal(bench->done);
+}
+
+// Fiber benchmark: creation and switch cost of fibers against threads
+int cmd_fibench(int argc, char **argv) {
+    fibench_t bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.n_fibers = (argc > 1) ? MAX(atoi(argv[1]), 1) : 1000;
+    bench.ping = moe_sem_create(0);
+    bench.pong = moe_sem_create(0);
+    bench.done = moe_sem_create(0);
+
+    moe_create_thread(&fibench_fiber_thread, 0, &bench, "fibench");
+    moe_sem_wait(bench.done, MOE_FOREVER);
+
+    moe_measure_t measure = moe_create_measure(0);
+    for (int i = 0; i < FIBENCH_THREADS; i++) {
+        moe_create_thread(&fibench_thread_nop, 0, &bench, "fibench");
+    }
+    for (int i = 0; i < FIBENCH_THREADS; i++) {
+        moe_sem_wait(bench.done, MOE_FOREVER);
+    }
+    bench.thread_create = moe_measure_diff(measure) * 1000 / FIBENCH_THREADS;
+
+    moe_create_thread(&fibench_thread_pong, 0, &bench, "fibench");
+    measure = moe_create_measure(0);
+    for (int i = 0; i < FIBENCH_ROUNDS; i++) {
+        moe_sem_signal(bench.ping);
+        moe_sem_wait(bench.pong, MOE_FOREVER);
+    }
+    bench.thread_sem = moe_measure_diff(measure) * 1000 / FIBENCH_ROUNDS;
+    moe_sem_wait(bench.done, MOE_FOREVER);
+
+    moe_free_object(bench.ping);
+    moe_free_object(bench.pong);
+    moe_free_object(bench.done);
+
+    printf("create+exit: fiber %lld ns, thread %lld ns\n", bench.fiber_create, bench.thread_create);
+    printf("switch: fiber yield %lld ns, ping-pong fiber %lld ns, thread %lld ns\n",
+        bench.fiber_yield, bench.fiber_sem, bench.thread_sem);
+    printf("%d fibers: %lld switches/sec, fiber stacks hit/miss %zu/%zu\n", bench.n_fibers, bench.fiber_mass,
+        (size_t)fiber_stack_pool.hits, (size_t)fiber_stack_pool.misses);
     return 0;
 }
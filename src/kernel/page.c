@@ -12,8 +12,10 @@ enum {
     MAX_PAGE_LEVEL = 4,
     SHIFT_PER_LEVEL = 9,
     NATIVE_PAGE_SIZE = 0x00001000,
-    VIRTUAL_PAGE_SIZE = 0x00010000,
     LARGE_PAGE_SIZE = 0x00200000,
+    HUGE_PAGE_SIZE = 0x40000000,
+    PAGES_PER_TABLE = 512,
+    VM_HASH_SIZE = 64,
     VRAM_PAGE = 0x100,
     DIRECT_MAP_PAGE = 0x140,
     RECURSIVE_PAGE = 0x1FE,
@@ -22,9 +24,31 @@ enum {
 static const uint64_t MAX_PA = UINT64_C(0x000000FFFFFFFFFF);
 static const uint64_t MAX_VA = UINT64_C(0x0000FFFFFFFFFFFF);
 static MOE_PHYSICAL_ADDRESS global_cr3;
-static _Atomic uintptr_t base_kernel_heap = 0;
+static int pg_has_huge_page;
+static uintptr_t direct_map_size, direct_map_page_size;
+static struct {
+    _Atomic uintptr_t ptes_written, tables_created;
+    _Atomic uintptr_t invlpg_flushes, full_flushes, shootdowns;
+} pg_stat;
 typedef uint64_t pte_t;
 
+// Kernel heap virtual address space; ranges are kept as offsets from heap_base
+typedef struct vm_area_t vm_area_t;
+struct vm_area_t {
+    vm_area_t *next;
+    uintptr_t base, size;
+    uintptr_t guard;
+};
+
+static struct {
+    moe_spinlock_t lock;
+    moe_cache_t *area_cache;
+    uintptr_t heap_base, heap_size;
+    vm_area_t *free_list;
+    vm_area_t *busy[VM_HASH_SIZE];
+    uintptr_t n_busy, busy_size, n_free;
+} vm;
+
 
 static void io_set_cr3(uintptr_t cr3) {
     __asm__ volatile("movq %0, %%cr3"::"r"(cr3));
@@ -35,6 +59,27 @@ static void io_invalidate_tlb() {
     __asm__ volatile("movq %%cr3, %0; movq %0, %%cr3;": "=r"(rax));
 }
 
+static void io_invlpg(uintptr_t va) {
+    __asm__ volatile("invlpg (%0)":: "r"(va): "memory");
+}
+
+
+static int cpu_has_huge_page() {
+    uint32_t eax = 0x80000001, ebx, ecx = 0, edx;
+    __asm__ volatile ("cpuid": "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return (edx & (1 << 26)) != 0;
+}
+
+
+static int cpu_physical_address_bits() {
+    uint32_t eax = 0x80000000, ebx, ecx = 0, edx;
+    __asm__ volatile ("cpuid": "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    if (eax < 0x80000008) return 36;
+    eax = 0x80000008;
+    __asm__ volatile ("cpuid": "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return eax & 0xFF;
+}
+
 
 static uintptr_t ceil_page(uintptr_t n, size_t page_size) {
     return ((n + page_size - 1) & ~(page_size - 1));
@@ -73,74 +118,624 @@ static uintptr_t root_page_to_va(uintptr_t page) {
 }
 
 
+/*********************************************************************/
+// TLB Shootdown
+
+void tlb_batch_add(tlb_batch_t *batch, uintptr_t va, size_t size) {
+    if (batch->flush_all) return;
+    if (batch->n_ranges > 0) {
+        tlb_range_t *last = &batch->ranges[batch->n_ranges - 1];
+        if (last->va + last->size == va) {
+            last->size += size;
+            return;
+        }
+    }
+    if (batch->n_ranges < TLB_BATCH_SIZE) {
+        tlb_range_t *range = &batch->ranges[batch->n_ranges++];
+        range->va = va;
+        range->size = size;
+    } else {
+        batch->flush_all = 1;
+    }
+}
+
+// Small batches are flushed page by page, large ones by reloading CR3
+void tlb_flush_local(const tlb_batch_t *batch) {
+    size_t n_pages = 0;
+    for (int i = 0; i < batch->n_ranges; i++) {
+        n_pages += ceil_page(batch->ranges[i].size, NATIVE_PAGE_SIZE) / NATIVE_PAGE_SIZE;
+    }
+    if (batch->flush_all || n_pages > TLB_INVLPG_THRESHOLD) {
+        io_invalidate_tlb();
+        atomic_fetch_add_explicit(&pg_stat.full_flushes, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&pg_stat.invlpg_flushes, 1, memory_order_relaxed);
+        for (int i = 0; i < batch->n_ranges; i++) {
+            const tlb_range_t *range = &batch->ranges[i];
+            for (uintptr_t va = range->va; va < range->va + range->size; va += NATIVE_PAGE_SIZE) {
+                io_invlpg(va);
+            }
+        }
+    }
+}
+
+void tlb_batch_flush(tlb_batch_t *batch) {
+    if (!batch->flush_all && !batch->n_ranges) return;
+    tlb_flush_local(batch);
+    if (smp_send_invalidate_tlb(batch)) {
+        atomic_fetch_add_explicit(&pg_stat.shootdowns, 1, memory_order_relaxed);
+    }
+    batch->n_ranges = 0;
+    batch->flush_all = 0;
+}
+
 void invalidate_tlb() {
-    io_invalidate_tlb();
-    smp_send_invalidate_tlb();
+    tlb_batch_t batch;
+    batch.n_ranges = 0;
+    batch.flush_all = 1;
+    tlb_batch_flush(&batch);
 }
 
 
-void *pg_map(uintptr_t base_pa, void *base_va, size_t size, uint64_t attributes) {
-    size_t count = ceil_page(size, NATIVE_PAGE_SIZE) / NATIVE_PAGE_SIZE;
+static uintptr_t level_page_size(int level) {
+    return (uintptr_t)NATIVE_PAGE_SIZE << (SHIFT_PER_LEVEL * (level - 1));
+}
+
+// Address of the table of the given level that maps va, seen through the recursive slot
+static uintptr_t rec_table_va(uintptr_t va, int level) {
+    return (get_rec_base(level) + va_to_offset(va, level)) & ~(uintptr_t)(NATIVE_PAGE_SIZE - 1);
+}
+
+// Returns the leaf entry mapping va and its level, or 0 if va is not mapped
+static pte_t pg_get_leaf(uintptr_t va, int *level) {
+    for (int j = MAX_PAGE_LEVEL; j > 1; j--) {
+        pte_t pte = pg_get_pte(va, j);
+        if (!(pte & PTE_PRESENT)) return 0;
+        if (j < MAX_PAGE_LEVEL && (pte & PTE_LARGE)) {
+            if (level) *level = j;
+            return pte;
+        }
+    }
+    if (level) *level = 1;
+    return pg_get_pte(va, 1);
+}
+
+// Replaces a large page with a table of the next smaller pages covering the same range;
+// used when an unmap or a protect covers only part of the large page
+static void pg_split_large(uintptr_t va, int level, tlb_batch_t *batch) {
+    pte_t large = pg_get_pte(va, level);
+    uintptr_t pa = large & MAX_PA & ~(level_page_size(level) - 1);
+    pte_t attributes = large & ~(MAX_PA & ~(NATIVE_PAGE_SIZE - 1));
+    uintptr_t child_size = level_page_size(level - 1);
+    if (level - 1 == 1) {
+        attributes &= ~PTE_LARGE;
+        if (large & PTE_LARGE_PAT) {
+            attributes |= PTE_PAT;
+        }
+    } else {
+        attributes |= large & PTE_LARGE_PAT;
+    }
+
+    uintptr_t table_pa = moe_alloc_physical_page(NATIVE_PAGE_SIZE);
+    moe_assert(table_pa, "PAGE TABLE EXHAUSTED\n");
+    pte_t *table = MOE_PA2VA(table_pa);
+    for (int i = 0; i < PAGES_PER_TABLE; i++) {
+        table[i] = (pa + i * child_size) | attributes;
+    }
+    pg_set_pte(va, table_pa | (large & PTE_USER) | PTE_PRESENT | PTE_WRITE, level);
+
+    // The recursive view of the new table used to alias the large page itself
+    uintptr_t rec_va = rec_table_va(va, level - 1);
+    io_invlpg(rec_va);
+    tlb_batch_add(batch, rec_va, NATIVE_PAGE_SIZE);
+}
+
+// Chooses the largest page that fits va, pa and the remaining size without replacing a table
+static int pg_leaf_level(uintptr_t va, uintptr_t pa, size_t size) {
+    for (int level = pg_has_huge_page ? 3 : 2; level > 1; level--) {
+        uintptr_t page_size = level_page_size(level);
+        if (((va | pa) & (page_size - 1)) || size < page_size) continue;
+        pte_t pte = 0;
+        int upper = MAX_PAGE_LEVEL;
+        for (; upper > level; upper--) {
+            pte = pg_get_pte(va, upper);
+            if (!(pte & PTE_PRESENT) || (upper < MAX_PAGE_LEVEL && (pte & PTE_LARGE))) break;
+        }
+        if (upper == level) {
+            pte = pg_get_pte(va, level);
+            if ((pte & PTE_PRESENT) && !(pte & PTE_LARGE)) continue;
+        }
+        return level;
+    }
+    return 1;
+}
+
+static volatile pte_t *pg_entry_ptr(uintptr_t va, int level) {
+    return (volatile pte_t *)(get_rec_base(level) + va_to_offset(va, level));
+}
+
+// Number of entries from va to the end of its table at the given level, capped by size
+static uintptr_t entries_in_table(uintptr_t va, size_t size, int level) {
+    uintptr_t page_size = level_page_size(level);
+    uintptr_t table_left = (level_page_size(level + 1) - (va & (level_page_size(level + 1) - 1))) / page_size;
+    return MIN(table_left, size / page_size);
+}
+
+// Makes sure the tables above the given level exist for va, splitting large pages in the way
+static void pg_prepare_tables(uintptr_t va, int level, pte_t common_attributes, tlb_batch_t *batch) {
+    for (int j = MAX_PAGE_LEVEL; j > level; j--) {
+        pte_t parent_tbl = pg_get_pte(va, j);
+        if (!parent_tbl) {
+            pte_t p_tbl = moe_alloc_physical_page(NATIVE_PAGE_SIZE);
+            moe_assert(p_tbl, "PAGE TABLE EXHAUSTED\n");
+            pte_t *table = MOE_PA2VA(p_tbl);
+            memset(table, 0, NATIVE_PAGE_SIZE);
+            pg_set_pte(va, (p_tbl | common_attributes), j);
+            io_invlpg(rec_table_va(va, j - 1));
+            atomic_fetch_add_explicit(&pg_stat.tables_created, 1, memory_order_relaxed);
+        } else if (j < MAX_PAGE_LEVEL && (parent_tbl & PTE_LARGE)) {
+            pg_split_large(va, j, batch);
+        }
+    }
+}
+
+// Rewrites every mapped leaf in [va, va + size) without flushing; attributes == 0 unmaps.
+// A rewrite keeps the memory type of the leaf, including what pg_split_large carried over
+static void pg_update_range(uintptr_t va, size_t size, uint64_t attributes, tlb_batch_t *batch) {
+    uintptr_t end = va + size;
+    uintptr_t n_written = 0;
+    for (uintptr_t p = va; p < end; ) {
+        int level = MAX_PAGE_LEVEL;
+        pte_t pte;
+        for (;;) {
+            pte = pg_get_pte(p, level);
+            if (level == 1 || !(pte & PTE_PRESENT) || (level < MAX_PAGE_LEVEL && (pte & PTE_LARGE))) break;
+            level--;
+        }
+        uintptr_t page_size = level_page_size(level);
+
+        if (level > 1 && !(pte & PTE_LARGE)) {
+            // skip the hole left by a missing table
+            uintptr_t next = (p | (page_size - 1)) + 1;
+            if (next <= p) break;
+            p = next;
+        } else if (level > 1) {
+            if ((p & (page_size - 1)) || p + page_size > end) {
+                pg_split_large(p, level, batch);
+                continue;
+            }
+            if (attributes) {
+                pte = (pte & MAX_PA & ~(page_size - 1)) | (pte & (PTE_PWT | PTE_PCD | PTE_LARGE_PAT)) | attributes | PTE_LARGE;
+            } else {
+                pte = 0;
+            }
+            pg_set_pte(p, pte, level);
+            tlb_batch_add(batch, p, page_size);
+            n_written++;
+            p += page_size;
+        } else {
+            // walk the rest of this table in one go
+            volatile pte_t *ptes = pg_entry_ptr(p, 1);
+            uintptr_t count = entries_in_table(p, end - p, 1);
+            for (uintptr_t i = 0; i < count; i++) {
+                pte_t old = ptes[i];
+                if (!old) continue;
+                ptes[i] = attributes ? ((old & MAX_PA & ~(NATIVE_PAGE_SIZE - 1)) | (old & (PTE_PWT | PTE_PCD | PTE_PAT)) | attributes) : 0;
+                tlb_batch_add(batch, p + i * NATIVE_PAGE_SIZE, NATIVE_PAGE_SIZE);
+                n_written++;
+            }
+            p += count * NATIVE_PAGE_SIZE;
+        }
+    }
+    atomic_fetch_add_explicit(&pg_stat.ptes_written, n_written, memory_order_relaxed);
+}
+
+// Maps [base_va, base_va + size) without flushing; must be called with interrupts disabled
+static void pg_map_leaves(uintptr_t base_pa, void *base_va, size_t size, uint64_t attributes, tlb_batch_t *batch) {
+    size = ceil_page(size, NATIVE_PAGE_SIZE);
     pte_t common_attributes = (attributes & PTE_USER) | PTE_PRESENT | PTE_WRITE;
-    uintptr_t flags = io_lock_irq();
-    for (size_t i = 0; i < count; i++) {
-        uintptr_t target_va = (uintptr_t)base_va + i * NATIVE_PAGE_SIZE;
-        uintptr_t target_pa = base_pa + i * NATIVE_PAGE_SIZE;
-        for (size_t j = MAX_PAGE_LEVEL; j > 1; j--) {
-            pte_t parent_tbl = pg_get_pte(target_va, j);
-            if (!parent_tbl) {
-                pte_t p_tbl = moe_alloc_physical_page(NATIVE_PAGE_SIZE);
-                pte_t *table = MOE_PA2VA(p_tbl);
-                memset(table, 0, NATIVE_PAGE_SIZE);
-                pg_set_pte(target_va, (p_tbl | common_attributes), j);
-                io_invalidate_tlb();
+    uintptr_t n_written = 0;
+    for (uintptr_t offset = 0; offset < size; ) {
+        uintptr_t target_va = (uintptr_t)base_va + offset;
+        uintptr_t target_pa = base_pa + offset;
+        int level = pg_leaf_level(target_va, target_pa, size - offset);
+        pg_prepare_tables(target_va, level, common_attributes, batch);
+
+        // Not-present entries are never cached, so only replaced mappings need a flush
+        uintptr_t page_size = level_page_size(level);
+        uintptr_t count = (level > 1) ? 1 : entries_in_table(target_va, size - offset, 1);
+        volatile pte_t *ptes = pg_entry_ptr(target_va, level);
+        pte_t leaf = target_pa | attributes | ((level > 1) ? PTE_LARGE : 0);
+        for (uintptr_t i = 0; i < count; i++) {
+            if (ptes[i] & PTE_PRESENT) {
+                tlb_batch_add(batch, target_va + i * page_size, page_size);
             }
+            ptes[i] = leaf + i * page_size;
         }
-        pg_set_pte(target_va, target_pa | attributes, 1);
+        n_written += count;
+        offset += count * page_size;
     }
-    invalidate_tlb();
-    io_restore_irq(flags);
+    atomic_fetch_add_explicit(&pg_stat.ptes_written, n_written, memory_order_relaxed);
+}
 
+void *pg_map_range(uintptr_t base_pa, void *base_va, size_t size, uint64_t attributes) {
+    tlb_batch_t batch;
+    batch.n_ranges = 0;
+    batch.flush_all = 0;
+    uintptr_t flags = io_lock_irq();
+    pg_map_leaves(base_pa, base_va, size, attributes, &batch);
+    tlb_batch_flush(&batch);
+    io_restore_irq(flags);
     return base_va;
 }
 
+void pg_unmap_range(void *base_va, size_t size) {
+    tlb_batch_t batch;
+    batch.n_ranges = 0;
+    batch.flush_all = 0;
+    uintptr_t flags = io_lock_irq();
+    pg_update_range((uintptr_t)base_va, ceil_page(size, NATIVE_PAGE_SIZE), 0, &batch);
+    tlb_batch_flush(&batch);
+    io_restore_irq(flags);
+}
+
+void pg_protect_range(void *base_va, size_t size, uint64_t attributes) {
+    tlb_batch_t batch;
+    batch.n_ranges = 0;
+    batch.flush_all = 0;
+    uintptr_t flags = io_lock_irq();
+    pg_update_range((uintptr_t)base_va, ceil_page(size, NATIVE_PAGE_SIZE), attributes | PTE_PRESENT, &batch);
+    tlb_batch_flush(&batch);
+    io_restore_irq(flags);
+}
+
+void pg_get_stat(pg_stat_t *stat) {
+    stat->ptes_written = pg_stat.ptes_written;
+    stat->tables_created = pg_stat.tables_created;
+    stat->invlpg_flushes = pg_stat.invlpg_flushes;
+    stat->full_flushes = pg_stat.full_flushes;
+    stat->shootdowns = pg_stat.shootdowns;
+    stat->direct_map_size = direct_map_size;
+    stat->direct_map_page_size = direct_map_page_size;
+}
 
 void *pg_map_mmio(uintptr_t base, size_t _size) {
     uintptr_t pa = base & MAX_PA & ~(NATIVE_PAGE_SIZE - 1);
-    return pg_map(pa, MOE_PA2VA(pa), _size, PTE_PRESENT | PTE_WRITE);
+    if (pa + _size <= direct_map_size) return MOE_PA2VA(pa);
+    return pg_map_range(pa, MOE_PA2VA(pa), _size, PTE_PRESENT | PTE_WRITE);
 }
 
 void *pg_map_vram(uintptr_t base, size_t size) {
-    return pg_map(base, (void *)root_page_to_va(VRAM_PAGE), size, PTE_NOT_EXECUTE | PTE_USER | PTE_WRITE | PTE_PRESENT);
+    const pte_t common_attributes = PTE_PRESENT | PTE_WRITE;
+    uintptr_t va = root_page_to_va(VRAM_PAGE);
+    if (!pg_get_pte(va, 4)) {
+        MOE_PHYSICAL_ADDRESS pml3v_pa = moe_alloc_physical_page(NATIVE_PAGE_SIZE);
+        pte_t *pml3v_va = MOE_PA2VA(pml3v_pa);
+        memset(pml3v_va, 0, NATIVE_PAGE_SIZE);
+
+        MOE_PHYSICAL_ADDRESS pml2v_pa = moe_alloc_physical_page(NATIVE_PAGE_SIZE);
+        pte_t *pml2v_va = MOE_PA2VA(pml2v_pa);
+        memset(pml2v_va, 0, NATIVE_PAGE_SIZE);
+        pml3v_va[0] = pml2v_pa | common_attributes | PTE_USER;
+
+        pg_set_pte(va, pml3v_pa | common_attributes | PTE_USER | PTE_NOT_EXECUTE, 4);
+    }
+    return pg_map_range(base, (void *)va, size, PTE_NOT_EXECUTE | PTE_USER | PTE_WRITE | PTE_PRESENT);
 }
 
 
 void *pg_map_user(uintptr_t base, size_t size, int reserved) {
     MOE_PHYSICAL_ADDRESS pa = moe_alloc_physical_page(size);
-    return pg_map(pa, (void *)base, size, PTE_USER | PTE_WRITE | PTE_PRESENT);
+    return pg_map_range(pa, (void *)base, size, PTE_USER | PTE_WRITE | PTE_PRESENT);
 }
 
-void *pg_valloc(uintptr_t pa, size_t size) {
-    size_t vsize = ceil_page(size, VIRTUAL_PAGE_SIZE) + VIRTUAL_PAGE_SIZE;
-    void *va = (void *)atomic_fetch_add(&base_kernel_heap, vsize);
-    pg_map(pa, va, size, PTE_PRESENT | PTE_WRITE);
+
+uintptr_t pg_va2pa(void *va) {
+    int level;
+    pte_t pte = pg_get_leaf((uintptr_t)va, &level);
+    if (!(pte & PTE_PRESENT)) return 0;
+    uintptr_t mask = level_page_size(level) - 1;
+    return (pte & MAX_PA & ~mask) | ((uintptr_t)va & mask);
+}
+
+/*********************************************************************/
+// Kernel Virtual Address Space
+
+static vm_area_t **vm_busy_slot(uintptr_t va) {
+    return &vm.busy[(va >> 12) % VM_HASH_SIZE];
+}
+
+// Takes the first free range that fits; must be called with vm.lock held
+static int vm_alloc_range(size_t size, size_t align, uintptr_t *result) {
+    for (vm_area_t **p = &vm.free_list; *p; p = &(*p)->next) {
+        vm_area_t *area = *p;
+        uintptr_t start = ceil_page(area->base, align);
+        uintptr_t end = area->base + area->size;
+        if (start < area->base || start + size > end) continue;
+
+        if (start + size < end) {
+            vm_area_t *tail = moe_cache_alloc(vm.area_cache);
+            if (!tail) return 0;
+            tail->base = start + size;
+            tail->size = end - tail->base;
+            tail->next = area->next;
+            area->next = tail;
+            vm.n_free++;
+        }
+        if (start > area->base) {
+            area->size = start - area->base;
+        } else {
+            *p = area->next;
+            moe_cache_free(vm.area_cache, area);
+            vm.n_free--;
+        }
+        *result = start;
+        return 1;
+    }
+    return 0;
+}
+
+// Returns a range to the sorted free list, merging it with its neighbours
+static void vm_free_range(uintptr_t base, size_t size) {
+    vm_area_t *prev = NULL, *next = vm.free_list;
+    while (next && next->base < base) {
+        prev = next;
+        next = next->next;
+    }
+    if (prev && prev->base + prev->size == base) {
+        prev->size += size;
+        if (next && prev->base + prev->size == next->base) {
+            prev->size += next->size;
+            prev->next = next->next;
+            moe_cache_free(vm.area_cache, next);
+            vm.n_free--;
+        }
+    } else if (next && base + size == next->base) {
+        next->base = base;
+        next->size += size;
+    } else {
+        vm_area_t *area = moe_cache_alloc(vm.area_cache);
+        moe_assert(area, "VM AREA EXHAUSTED\n");
+        area->base = base;
+        area->size = size;
+        area->next = next;
+        if (prev) {
+            prev->next = area;
+        } else {
+            vm.free_list = area;
+        }
+        vm.n_free++;
+    }
+}
+
+static void vm_init_locked() {
+    if (vm.area_cache) return;
+    vm.area_cache = moe_cache_create("vm_area", sizeof(vm_area_t), 0, NULL);
+    vm_area_t *area = moe_cache_alloc(vm.area_cache);
+    moe_assert(area, "VM INIT FAILED\n");
+    area->base = 0;
+    area->size = vm.heap_size;
+    vm.free_list = area;
+    vm.n_free = 1;
+}
+
+// Unmaps [va, va + size) and detaches the page tables left empty; must be called with vm.lock held.
+// Returns the detached tables chained through their first entry, to be freed after the flush.
+static uintptr_t pg_unmap_heap(uintptr_t va, size_t size, tlb_batch_t *batch) {
+    uintptr_t empty_tables = 0;
+
+    pg_update_range(va, size, 0, batch);
+
+    for (int level = 2; level < MAX_PAGE_LEVEL; level++) {
+        uintptr_t span = (uintptr_t)NATIVE_PAGE_SIZE << (SHIFT_PER_LEVEL * (level - 1));
+        uintptr_t first = va & ~(span - 1);
+        for (uintptr_t p = first; p < va + size && p >= first; p += span) {
+            pte_t parent = pg_get_pte(p, level);
+            if (!(parent & PTE_PRESENT) || (parent & PTE_LARGE)) continue;
+            int upper_present = 1;
+            for (int i = MAX_PAGE_LEVEL; i > level; i--) {
+                if (!(pg_get_pte(p, i) & PTE_PRESENT)) upper_present = 0;
+            }
+            if (!upper_present) continue;
+
+            pte_t *table = (pte_t *)(get_rec_base(level - 1) + va_to_offset(p, level - 1));
+            int empty = 1;
+            for (int i = 0; i < PAGES_PER_TABLE; i++) {
+                if (table[i]) {
+                    empty = 0;
+                    break;
+                }
+            }
+            if (!empty) continue;
+
+            uintptr_t table_pa = parent & MAX_PA & ~(NATIVE_PAGE_SIZE - 1);
+            pg_set_pte(p, 0, level);
+            tlb_batch_add(batch, rec_table_va(p, level - 1), NATIVE_PAGE_SIZE);
+            *(uintptr_t *)MOE_PA2VA(table_pa) = empty_tables;
+            empty_tables = table_pa;
+        }
+    }
+
+    return empty_tables;
+}
+
+static void *vm_map(uintptr_t pa, size_t size, uintptr_t guard) {
+    size = ceil_page(size, NATIVE_PAGE_SIZE);
+    uintptr_t guard_size = guard * NATIVE_PAGE_SIZE;
+    vm_area_t *record = NULL;
+    void *va = NULL;
+    tlb_batch_t batch;
+    batch.n_ranges = 0;
+    batch.flush_all = 0;
+
+    uintptr_t flags = moe_spinlock_acquire_irq(&vm.lock);
+    vm_init_locked();
+    // Runs of whole large pages get a matching VA alignment so that pg_map can use them
+    size_t align = NATIVE_PAGE_SIZE;
+    if (pa && !guard && size >= LARGE_PAGE_SIZE && (pa & (LARGE_PAGE_SIZE - 1)) == 0) {
+        align = LARGE_PAGE_SIZE;
+    }
+    uintptr_t base;
+    record = moe_cache_alloc(vm.area_cache);
+    if (record && vm_alloc_range(size + 2 * guard_size, align, &base)) {
+        va = (void *)(vm.heap_base + base + guard_size);
+        record->base = (uintptr_t)va;
+        record->size = size;
+        record->guard = guard;
+        vm_area_t **slot = vm_busy_slot(record->base);
+        record->next = *slot;
+        *slot = record;
+        vm.n_busy++;
+        vm.busy_size += size;
+        // Mapped under the lock so that pg_vfree never detaches a table being filled here
+        if (pa) {
+            pg_map_leaves(pa, va, size, PTE_PRESENT | PTE_WRITE, &batch);
+        }
+    } else if (record) {
+        moe_cache_free(vm.area_cache, record);
+    }
+    moe_spinlock_release(&vm.lock);
+
+    // Same as pg_vfree, the shootdown must not hold vm.lock
+    tlb_batch_flush(&batch);
+    io_restore_irq(flags);
+
     return va;
 }
 
+void *pg_valloc(uintptr_t pa, size_t size) {
+    return vm_map(pa, size, 0);
+}
+
+// Same as pg_valloc, but leaves an unmapped page on both sides of the range
+void *pg_valloc_guarded(uintptr_t pa, size_t size) {
+    return vm_map(pa, size, 1);
+}
 
+// Unmaps a range from pg_valloc and returns its size, or 0 if va is not the start of one
+size_t pg_vfree(void *va) {
+    size_t size = 0;
+    uintptr_t empty_tables = 0, range_base = 0, range_size = 0;
+    tlb_batch_t batch;
+    batch.n_ranges = 0;
+    batch.flush_all = 0;
+
+    uintptr_t flags = io_lock_irq();
+    moe_spinlock_acquire(&vm.lock);
+    for (vm_area_t **p = vm_busy_slot((uintptr_t)va); *p; p = &(*p)->next) {
+        vm_area_t *record = *p;
+        if (record->base != (uintptr_t)va) continue;
+        *p = record->next;
+        size = record->size;
+        uintptr_t guard_size = record->guard * NATIVE_PAGE_SIZE;
+        empty_tables = pg_unmap_heap(record->base, size, &batch);
+        range_base = record->base - vm.heap_base - guard_size;
+        range_size = size + 2 * guard_size;
+        vm.n_busy--;
+        vm.busy_size -= size;
+        moe_cache_free(vm.area_cache, record);
+        break;
+    }
+    moe_spinlock_release(&vm.lock);
+
+    // The shootdown waits for other CPUs, so it must not hold vm.lock;
+    // the range is reused only after every CPU has dropped it
+    if (size) {
+        tlb_batch_flush(&batch);
+        while (empty_tables) {
+            uintptr_t next = *(uintptr_t *)MOE_PA2VA(empty_tables);
+            moe_free_physical_page(empty_tables, NATIVE_PAGE_SIZE);
+            empty_tables = next;
+        }
+        moe_spinlock_acquire(&vm.lock);
+        vm_free_range(range_base, range_size);
+        moe_spinlock_release(&vm.lock);
+    }
+    io_restore_irq(flags);
+    return size;
+}
+
+void pg_get_vm_info(size_t *n_areas, size_t *size, size_t *n_free) {
+    *n_areas = vm.n_busy;
+    *size = vm.busy_size;
+    *n_free = vm.n_free;
+}
+
+// Runs at low priority, so zeroing mostly takes cycles that normal threads leave unused;
+// priority_idle is reserved for the per-CPU idle threads
 _Noreturn void page_process(void *args) {
     for (;;) {
-        moe_usleep(MOE_FOREVER);
+        if (!mm_zero_pages()) {
+            moe_usleep(100000);
+        }
     }
 }
 
 void pg_enter_strict_mode() {
-    // moe_create_process(&page_process, priority_realtime, NULL, "page");
+    moe_create_process(&page_process, priority_low, NULL, "page");
     pg_set_pte(0, 0, 4);
     invalidate_tlb();
 }
 
 
+// Tables built before mm_init come from the head of the boot allocator's run,
+// which is still identity mapped at this point
+static uintptr_t boot_alloc_table(moe_bootinfo_t *bootinfo) {
+    uintptr_t pa = atomic_fetch_add(&bootinfo->static_start, NATIVE_PAGE_SIZE);
+    atomic_fetch_sub(&bootinfo->free_memory, NATIVE_PAGE_SIZE);
+    memset((void *)pa, 0, NATIVE_PAGE_SIZE);
+    return pa;
+}
+
+// Returns the end of the highest range in the firmware memory map, MMIO included
+static uintptr_t boot_highest_address(moe_bootinfo_t *bootinfo) {
+    uintptr_t result = UINT64_C(0x100000000);
+    for (uintptr_t i = 0; bootinfo->mmdescsz && i < bootinfo->mmsize / bootinfo->mmdescsz; i++) {
+        const efi_memory_descriptor_t *desc = (const void *)(bootinfo->mmbase + i * bootinfo->mmdescsz);
+        uintptr_t end = desc->physical_start + desc->n_pages * NATIVE_PAGE_SIZE;
+        if (end > result) result = end;
+    }
+    return result;
+}
+
+// Maps the whole physical address space at DIRECT_MAP_PAGE, so that MOE_PA2VA
+// needs no page table updates for RAM or for BARs above 4GB
+static void pg_init_direct_map(moe_bootinfo_t *bootinfo, pte_t *pml4_va) {
+    const pte_t common_attributes = PTE_PRESENT | PTE_WRITE;
+    const uintptr_t pml4_size = (uintptr_t)HUGE_PAGE_SIZE * PAGES_PER_TABLE;
+    const uintptr_t max_slots = RECURSIVE_PAGE - DIRECT_MAP_PAGE;
+
+    uintptr_t limit;
+    if (pg_has_huge_page) {
+        limit = (uintptr_t)1 << cpu_physical_address_bits();
+        direct_map_page_size = HUGE_PAGE_SIZE;
+    } else {
+        // Without 1GB pages every GB costs a table, so stop at the firmware's highest range
+        limit = ceil_page(boot_highest_address(bootinfo), HUGE_PAGE_SIZE);
+        direct_map_page_size = LARGE_PAGE_SIZE;
+    }
+    limit = MIN(limit, max_slots * pml4_size);
+
+    for (uintptr_t slot = 0; slot * pml4_size < limit; slot++) {
+        pte_t *pml3 = (pte_t *)boot_alloc_table(bootinfo);
+        for (uintptr_t i = 0; i < PAGES_PER_TABLE; i++) {
+            uintptr_t pa = slot * pml4_size + i * HUGE_PAGE_SIZE;
+            if (pa >= limit) break;
+            if (pg_has_huge_page) {
+                pml3[i] = pa | common_attributes | PTE_LARGE;
+            } else {
+                pte_t *pml2 = (pte_t *)boot_alloc_table(bootinfo);
+                for (uintptr_t j = 0; j < PAGES_PER_TABLE; j++) {
+                    pml2[j] = (pa + j * LARGE_PAGE_SIZE) | common_attributes | PTE_LARGE;
+                }
+                pml3[i] = (uintptr_t)pml2 | common_attributes;
+            }
+        }
+        pml4_va[DIRECT_MAP_PAGE + slot] = (uintptr_t)pml3 | common_attributes;
+    }
+    direct_map_size = limit;
+}
+
 void page_init(moe_bootinfo_t *bootinfo) {
 
     const pte_t common_attributes = PTE_PRESENT | PTE_WRITE;
@@ -149,22 +744,17 @@ void page_init(moe_bootinfo_t *bootinfo) {
     global_cr3 = bootinfo->master_cr3;
     pte_t *pml4_va = (pte_t *)global_cr3;
     pml4_va[RECURSIVE_PAGE] = global_cr3 | common_attributes;
-    pml4_va[DIRECT_MAP_PAGE] = pml4_va[0];
-
-    base_kernel_heap = root_page_to_va(KERNEL_HEAP_PAGE);
-
-    // VRAM
-    MOE_PHYSICAL_ADDRESS pml3v_pa = moe_alloc_physical_page(NATIVE_PAGE_SIZE);
-    uint64_t *pml3v_va = (uint64_t *)pml3v_pa;
-    memset(pml3v_va, 0, NATIVE_PAGE_SIZE);
-    pml4_va[VRAM_PAGE] = pml3v_pa | common_attributes | PTE_USER | PTE_NOT_EXECUTE;
 
-    pte_t pml2v_pa = moe_alloc_physical_page(NATIVE_PAGE_SIZE);
-    pte_t *pml2v_va = (pte_t *)pml2v_pa;
-    memset(pml2v_va, 0, NATIVE_PAGE_SIZE);
-    pml3v_va[0] = pml2v_pa | common_attributes | PTE_USER;
+    pg_has_huge_page = cpu_has_huge_page();
+    pg_init_direct_map(bootinfo, pml4_va);
+    vm.heap_base = root_page_to_va(KERNEL_HEAP_PAGE);
+    // The kernel image and the boot stack live at the top of the same slot
+    vm.heap_size = bootinfo->kernel_base - vm.heap_base;
 
+    // The direct map must be usable before mm_init builds the free lists,
+    // so the VRAM tables are created later by pg_map_vram
     io_set_cr3(global_cr3);
+    moe_spinlock_register(&vm.lock, "vm");
 
 }
 
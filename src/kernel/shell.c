@@ -58,11 +58,21 @@ int cmd_shutdown(int argc, char **argv) {
 int cmd_help(int argc, char **argv);
 int cmd_cpuid(int argc, char **argv) __attribute__((weak));
 int cmd_ps(int argc, char **argv) __attribute__((weak));
+int cmd_pin(int argc, char **argv) __attribute__((weak));
+int cmd_lockstat(int argc, char **argv) __attribute__((weak));
 int cmd_exp(int argc, char **argv);
 int cmd_stall(int argc, char **argv);
 int cmd_lsusb(int argc, char **argv) __attribute__((weak));
 int cmd_lspci(int argc, char **argv) __attribute__((weak));
 int cmd_mode(int argc, char **argv) __attribute__((weak));
+int cmd_pgbench(int argc, char **argv) __attribute__((weak));
+int cmd_meminfo(int argc, char **argv) __attribute__((weak));
+int cmd_mmbench(int argc, char **argv) __attribute__((weak));
+int cmd_csbench(int argc, char **argv) __attribute__((weak));
+int cmd_sembench(int argc, char **argv) __attribute__((weak));
+int cmd_fibench(int argc, char **argv) __attribute__((weak));
+int cmd_qbench(int argc, char **argv) __attribute__((weak));
+int cmd_lswq(int argc, char **argv) __attribute__((weak));
 
 command_list_t commands[] = {
     { "help", cmd_help, "Display this help" },
@@ -73,10 +83,20 @@ command_list_t commands[] = {
     { "cpuid", cmd_cpuid, "Show cpuid information" },
     { "lspci", cmd_lspci, "Show pci informations" },
     { "lsusb", cmd_lsusb, "Show usb informations" },
+    { "meminfo", cmd_meminfo, "Show memory informations" },
     { "ps", cmd_ps, NULL },
+    { "pin", cmd_pin, NULL },
+    { "lockstat", cmd_lockstat, NULL },
     { "exp", cmd_exp, NULL },
     { "stall", cmd_stall, NULL},
     { "mode", cmd_mode, NULL},
+    { "pgbench", cmd_pgbench, NULL},
+    { "mmbench", cmd_mmbench, NULL},
+    { "csbench", cmd_csbench, NULL},
+    { "sembench", cmd_sembench, NULL},
+    { "fibench", cmd_fibench, NULL},
+    { "qbench", cmd_qbench, NULL},
+    { "lswq", cmd_lswq, NULL},
     { 0 },
 };
 
@@ -203,7 +223,7 @@ int read_cmdline(char* buffer, size_t max_len) {
 
 void shell_start(const wchar_t *cmdline) {
 
-    cin = moe_queue_create(256);
+    cin = moe_queue_create_with_flags(256, MOE_QUEUE_SINGLE_CONSUMER);
 
     cmd_ver(0, NULL);
 
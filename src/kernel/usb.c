@@ -143,9 +143,26 @@ static usb_class_driver_declaration interface_class_driver_list[] = {
 };
 
 
+static _Atomic (moe_dma_pool_t *) usb_buffer_pool;
+
+static moe_dma_pool_t *get_buffer_pool() {
+    moe_dma_pool_t *pool = atomic_load(&usb_buffer_pool);
+    if (!pool) {
+        moe_dma_pool_t *new_pool = moe_dma_pool_create("usb.buffer", MAX_USB_BUFFER, MAX_USB_BUFFER, 0);
+        if (atomic_compare_exchange_strong(&usb_buffer_pool, &pool, new_pool)) {
+            pool = new_pool;
+        } else {
+            moe_dma_pool_destroy(new_pool);
+        }
+    }
+    return pool;
+}
+
 void usb_dealloc(void *context) {
-    // usb_device *self = context;
-    // TODO: release buffer
+    usb_device *self = context;
+    moe_dma_pool_free(get_buffer_pool(), self->buffer);
+    self->buffer = NULL;
+    self->base_buffer = 0;
 }
 
 void usb_release(usb_device *self) {
@@ -271,8 +288,7 @@ int usb_new_device(usb_host_interface_t *hci) {
 
     usb_device *self = moe_alloc_object(sizeof(usb_device), 1);
     moe_shared_init(&self->shared, self);
-    self->base_buffer = moe_alloc_io_buffer(MAX_USB_BUFFER);
-    self->buffer = MOE_PA2VA(self->base_buffer);
+    self->buffer = moe_dma_pool_alloc(get_buffer_pool(), &self->base_buffer);
     self->isAlive = true;
     self->strings = moe_alloc_object(MAX_STRING_BUFFER, 1);
     self->hci = hci;
@@ -589,6 +605,7 @@ void usb_hub_thread(void *args) {
     }
 
     usb_release(self->device);
+    moe_free_object(self);
 }
 
 void usb_hub_class_driver(usb_device *self, int ifno) {
@@ -689,6 +706,7 @@ void hid_thread(void *args) {
     }
 
     usb_release(self->device);
+    moe_free_object(self);
 }
 
 void hid_start_class_driver(usb_device *self, int ifno) {
@@ -784,6 +802,7 @@ void xinput_thread(void *args) {
     }
 
     usb_release(self->device);
+    moe_free_object(self);
 }
 
 void xinput_class_driver(usb_device *self, int ifno) {
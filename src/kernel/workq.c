@@ -0,0 +1,423 @@
+// Work Queue
+// Copyright (c) 2019 MEG-OS project, All rights reserved.
+// License: MIT
+
+#include <stdatomic.h>
+#include "moe.h"
+#include "kernel.h"
+
+
+#define WORK_QUEUE_NAME_SIZE    16
+#define WORK_MAX_WORKERS        16
+#define WORK_IDLE_TIMEOUT       5000000
+#define WORK_MANAGER_INTERVAL   10000
+#define WORK_FLUSH_INTERVAL     1000
+
+extern int smp_get_current_cpuid();
+
+typedef struct work_pool_t work_pool_t;
+
+typedef struct moe_work_t {
+    struct moe_work_t *next;
+    moe_work_func func;
+    void *args;
+    // Guards the flags below; taken before the pool or queue lock
+    moe_spinlock_t lock;
+    moe_work_queue_t *wq;
+    work_pool_t *pool;
+    moe_measure_t deadline;
+    int cpuid;
+    int runner;
+    // linked changes only under the lock of the list it is on
+    uint8_t pending, running, linked, delayed;
+} moe_work_t;
+
+// Work queued on a CPU and the workers serving it there
+typedef struct work_pool_t {
+    moe_spinlock_t lock;
+    moe_work_t *head, *tail;
+    moe_semaphore_t *sem;
+    moe_work_queue_t *wq;
+    int cpuid;
+    _Atomic int n_workers, n_idle;
+    _Atomic uintptr_t n_queued, n_done;
+    uintptr_t last_done;
+} work_pool_t;
+
+typedef struct moe_work_queue_t {
+    char name[WORK_QUEUE_NAME_SIZE];
+    moe_priority_level_t priority;
+    // Delayed work sorted by deadline
+    moe_spinlock_t lock;
+    moe_work_t *delayed;
+    moe_semaphore_t *sem_manager;
+    int n_pools;
+    work_pool_t pools[];
+} moe_work_queue_t;
+
+static moe_work_queue_t *system_work_queue;
+
+
+static uintptr_t work_lock(moe_spinlock_t *lock) {
+    uintptr_t flags = moe_spinlock_acquire_irq(lock);
+    return flags;
+}
+
+static void work_unlock(moe_spinlock_t *lock, uintptr_t flags) {
+    moe_spinlock_release_irq(lock, flags);
+}
+
+// Must be called with the work lock held; a work is on one list at most
+static void work_pool_push(work_pool_t *pool, moe_work_t *work) {
+    if (work->linked) return;
+    uintptr_t flags = work_lock(&pool->lock);
+    work->next = NULL;
+    if (pool->tail) {
+        pool->tail->next = work;
+    } else {
+        pool->head = work;
+    }
+    pool->tail = work;
+    work->pool = pool;
+    work->linked = 1;
+    atomic_fetch_add(&pool->n_queued, 1);
+    work_unlock(&pool->lock, flags);
+    moe_sem_signal(pool->sem);
+}
+
+static moe_work_t *work_pool_pop(work_pool_t *pool) {
+    uintptr_t flags = work_lock(&pool->lock);
+    moe_work_t *work = pool->head;
+    if (work) {
+        pool->head = work->next;
+        if (!pool->head) pool->tail = NULL;
+        work->next = NULL;
+        work->linked = 0;
+    }
+    work_unlock(&pool->lock, flags);
+    return work;
+}
+
+// Must be called with the work lock held; returns 0 if it was still on the list
+static int work_pool_unlink(work_pool_t *pool, moe_work_t *work) {
+    int retval = -1;
+    uintptr_t flags = work_lock(&pool->lock);
+    if (work->linked) {
+        moe_work_t **p = &pool->head, *prev = NULL;
+        while (*p && *p != work) {
+            prev = *p;
+            p = &(*p)->next;
+        }
+        if (*p) {
+            *p = work->next;
+            if (pool->tail == work) pool->tail = prev;
+        }
+        work->next = NULL;
+        work->linked = 0;
+        atomic_fetch_add(&pool->n_done, 1);
+        retval = 0;
+    }
+    work_unlock(&pool->lock, flags);
+    return retval;
+}
+
+// Must be called with the work lock held
+static int work_delayed_unlink(moe_work_queue_t *wq, moe_work_t *work) {
+    int retval = -1;
+    uintptr_t flags = work_lock(&wq->lock);
+    if (work->linked) {
+        moe_work_t **p = &wq->delayed;
+        while (*p && *p != work) {
+            p = &(*p)->next;
+        }
+        if (*p) *p = work->next;
+        work->next = NULL;
+        work->linked = 0;
+        retval = 0;
+    }
+    work_unlock(&wq->lock, flags);
+    return retval;
+}
+
+static void work_spawn(work_pool_t *pool);
+
+static void work_run(work_pool_t *pool, moe_work_t *work) {
+    uintptr_t flags = work_lock(&work->lock);
+    if (!work->pending || work->delayed || work->running) {
+        // Cancelled after it was taken off the list, or its current run requeues it
+        work_unlock(&work->lock, flags);
+        atomic_fetch_add(&pool->n_done, 1);
+        return;
+    }
+    work->pending = 0;
+    work->running = 1;
+    work->runner = moe_get_current_thread_id();
+    work_unlock(&work->lock, flags);
+
+    work->func(work->args);
+
+    flags = work_lock(&work->lock);
+    work->running = 0;
+    work->runner = 0;
+    // Queued again while running; it stays here so that it never runs on two CPUs at once
+    if (work->pending && !work->delayed) {
+        work_pool_push(pool, work);
+    }
+    work_unlock(&work->lock, flags);
+    atomic_fetch_add(&pool->n_done, 1);
+}
+
+static void work_worker_thread(void *args) {
+    work_pool_t *pool = args;
+    moe_set_thread_affinity(moe_get_current_thread_id(), 1 << pool->cpuid);
+    for (;;) {
+        atomic_fetch_add(&pool->n_idle, 1);
+        int timeout = moe_sem_wait(pool->sem, WORK_IDLE_TIMEOUT);
+        atomic_fetch_add(&pool->n_idle, -1);
+        if (timeout) {
+            // Idle for a while, so retire unless this is the last one
+            int n_workers = atomic_load(&pool->n_workers);
+            if (n_workers > 1 && atomic_compare_exchange_strong(&pool->n_workers, &n_workers, n_workers - 1)) break;
+            continue;
+        }
+        moe_work_t *work = work_pool_pop(pool);
+        if (!work) continue;
+        // Keep someone around for the rest of the queue in case this one blocks
+        if (pool->head && !atomic_load(&pool->n_idle)) {
+            work_spawn(pool);
+        }
+        work_run(pool, work);
+    }
+    moe_exit_thread(0);
+}
+
+static void work_spawn(work_pool_t *pool) {
+    int n_workers = atomic_load(&pool->n_workers);
+    do {
+        if (n_workers >= WORK_MAX_WORKERS) return;
+    } while (!atomic_compare_exchange_weak(&pool->n_workers, &n_workers, n_workers + 1));
+    char name[32];
+    snprintf(name, 32, "%s/%d", pool->wq->name, pool->cpuid);
+    if (!moe_create_thread(&work_worker_thread, pool->wq->priority, pool, name)) {
+        atomic_fetch_add(&pool->n_workers, -1);
+    }
+}
+
+// Moves delayed work that is due to the pool of the CPU that queued it; returns the time to the next one
+static int64_t work_promote_delayed(moe_work_queue_t *wq) {
+    for (;;) {
+        uintptr_t flags = work_lock(&wq->lock);
+        moe_work_t *work = wq->delayed;
+        if (work && moe_measure_until(work->deadline)) {
+            int64_t us = MAX(-moe_measure_diff(work->deadline), 0);
+            work_unlock(&wq->lock, flags);
+            return us;
+        }
+        if (work) {
+            wq->delayed = work->next;
+            work->next = NULL;
+            work->linked = 0;
+        }
+        work_unlock(&wq->lock, flags);
+        if (!work) return MOE_FOREVER;
+
+        flags = work_lock(&work->lock);
+        if (work->pending && work->delayed && !work->linked) {
+            work->delayed = 0;
+            if (!work->running) {
+                work_pool_push(&wq->pools[work->cpuid], work);
+            }
+        }
+        work_unlock(&work->lock, flags);
+    }
+}
+
+// Runs delayed work and adds workers to pools that stopped making progress
+static void work_manager_thread(void *args) {
+    moe_work_queue_t *wq = args;
+    for (;;) {
+        int64_t timeout = work_promote_delayed(wq);
+        for (int i = 0; i < wq->n_pools; i++) {
+            work_pool_t *pool = &wq->pools[i];
+            uintptr_t n_done = atomic_load(&pool->n_done);
+            int busy = atomic_load(&pool->n_idle) < atomic_load(&pool->n_workers);
+            if (busy) {
+                if (pool->head && !atomic_load(&pool->n_idle) && n_done == pool->last_done) {
+                    work_spawn(pool);
+                }
+                timeout = MIN(timeout, WORK_MANAGER_INTERVAL);
+            }
+            pool->last_done = n_done;
+        }
+        moe_sem_wait(wq->sem_manager, timeout);
+    }
+}
+
+
+/*********************************************************************/
+
+
+moe_work_queue_t *moe_work_queue_create(const char *name, moe_priority_level_t priority) {
+    int n_pools = moe_get_number_of_active_cpus();
+    moe_work_queue_t *wq = moe_alloc_object(sizeof(moe_work_queue_t) + sizeof(work_pool_t) * n_pools, 1);
+    if (!wq) return NULL;
+    strncpy(wq->name, name, WORK_QUEUE_NAME_SIZE - 1);
+    wq->priority = priority ? priority : priority_normal;
+    wq->n_pools = n_pools;
+    wq->sem_manager = moe_sem_create(0);
+    moe_spinlock_register(&wq->lock, "workq.delayed");
+    for (int i = 0; i < n_pools; i++) {
+        work_pool_t *pool = &wq->pools[i];
+        pool->wq = wq;
+        pool->cpuid = i;
+        pool->sem = moe_sem_create(0);
+        moe_spinlock_register(&pool->lock, "workq.pool");
+        work_spawn(pool);
+    }
+    moe_create_thread(&work_manager_thread, priority_high, wq, wq->name);
+    return wq;
+}
+
+moe_work_t *moe_create_work(moe_work_func func, void *args) {
+    moe_work_t *work = moe_alloc_object(sizeof(moe_work_t), 1);
+    if (work) {
+        work->func = func;
+        work->args = args;
+    }
+    return work;
+}
+
+void moe_destroy_work(moe_work_t *work) {
+    if (!work) return;
+    moe_cancel_work(work);
+    moe_free_object(work);
+}
+
+// Queues work on the current CPU; returns -1 if it is already pending. Safe in IRQ handlers
+int moe_queue_work(moe_work_queue_t *wq, moe_work_t *work) {
+    if (!wq) wq = system_work_queue;
+    if (!wq) return -1;
+    uintptr_t flags = work_lock(&work->lock);
+    if (work->pending) {
+        work_unlock(&work->lock, flags);
+        return -1;
+    }
+    work->pending = 1;
+    work->wq = wq;
+    work->cpuid = smp_get_current_cpuid();
+    // A running work is queued again by its worker when it returns
+    if (!work->running) {
+        work_pool_push(&wq->pools[work->cpuid], work);
+    }
+    work_unlock(&work->lock, flags);
+    return 0;
+}
+
+int moe_queue_delayed_work(moe_work_queue_t *wq, moe_work_t *work, int64_t us) {
+    if (us <= 0) return moe_queue_work(wq, work);
+    if (!wq) wq = system_work_queue;
+    if (!wq) return -1;
+    uintptr_t flags = work_lock(&work->lock);
+    if (work->pending) {
+        work_unlock(&work->lock, flags);
+        return -1;
+    }
+    work->pending = 1;
+    work->delayed = 1;
+    work->wq = wq;
+    work->cpuid = smp_get_current_cpuid();
+    work->deadline = moe_create_measure(us);
+    // Left on a pool list by a cancel that raced with its worker
+    if (work->linked) {
+        work_pool_unlink(work->pool, work);
+    }
+
+    uintptr_t flags2 = work_lock(&wq->lock);
+    moe_work_t **p = &wq->delayed;
+    while (*p && moe_measure_diff((*p)->deadline) >= moe_measure_diff(work->deadline)) {
+        p = &(*p)->next;
+    }
+    int earliest = (p == &wq->delayed);
+    work->next = *p;
+    *p = work;
+    work->linked = 1;
+    work_unlock(&wq->lock, flags2);
+    work_unlock(&work->lock, flags);
+
+    if (earliest) {
+        moe_sem_signal(wq->sem_manager);
+    }
+    return 0;
+}
+
+// Cancels pending work and waits for a running one to return; returns 0 if it was pending
+int moe_cancel_work(moe_work_t *work) {
+    int retval = -1;
+    uintptr_t flags = work_lock(&work->lock);
+    if (work->pending) {
+        if (work->delayed) {
+            work_delayed_unlink(work->wq, work);
+        } else if (work->pool) {
+            work_pool_unlink(work->pool, work);
+        }
+        work->pending = 0;
+        work->delayed = 0;
+        retval = 0;
+    }
+    work_unlock(&work->lock, flags);
+    if (work->runner != moe_get_current_thread_id()) {
+        while (work->running) {
+            moe_usleep(WORK_FLUSH_INTERVAL);
+        }
+    }
+    return retval;
+}
+
+// Runs delayed work now and waits until the work is neither pending nor running
+void moe_flush_work(moe_work_t *work) {
+    uintptr_t flags = work_lock(&work->lock);
+    if (work->pending && work->delayed && !work_delayed_unlink(work->wq, work)) {
+        work->delayed = 0;
+        if (!work->running) {
+            work_pool_push(&work->wq->pools[work->cpuid], work);
+        }
+    }
+    work_unlock(&work->lock, flags);
+    if (work->runner == moe_get_current_thread_id()) return;
+    while (work->pending || work->running) {
+        moe_usleep(WORK_FLUSH_INTERVAL);
+    }
+}
+
+// Waits for work queued so far; delayed work that is not due yet is not waited for
+void moe_flush_work_queue(moe_work_queue_t *wq) {
+    if (!wq) wq = system_work_queue;
+    if (!wq) return;
+    for (int i = 0; i < wq->n_pools; i++) {
+        work_pool_t *pool = &wq->pools[i];
+        uintptr_t n_queued = atomic_load(&pool->n_queued);
+        while ((intptr_t)(atomic_load(&pool->n_done) - n_queued) < 0) {
+            moe_usleep(WORK_FLUSH_INTERVAL);
+        }
+    }
+}
+
+void workq_init() {
+    system_work_queue = moe_work_queue_create("kworker", priority_high);
+}
+
+
+/*********************************************************************/
+
+
+int cmd_lswq(int argc, char **argv) {
+    moe_work_queue_t *wq = system_work_queue;
+    if (!wq) return 1;
+    printf("CPU workers idle   queued     done\n");
+    for (int i = 0; i < wq->n_pools; i++) {
+        work_pool_t *pool = &wq->pools[i];
+        printf("%3d %7d %4d %8zu %8zu\n", i, pool->n_workers, pool->n_idle,
+            (size_t)pool->n_queued, (size_t)pool->n_done);
+    }
+    return 0;
+}
@@ -76,8 +76,11 @@ typedef struct xhci_t {
     moe_semaphore_t *sem_config_thread;
     moe_semaphore_t *sem_control;
     moe_semaphore_t *sem_config_mode;
+    // Commands sleep until they complete, so they are serialized by a semaphore rather than a spinlock
+    moe_semaphore_t *sem_command;
 
     ring_context tr_ctx[MAX_TR];
+    moe_dma_pool_t *ring_pool, *context_pool, *input_pool;
 
     MOE_PHYSICAL_ADDRESS base_address, base_portsc;
     xhci_cap_t *cap;
@@ -159,8 +162,8 @@ static uintptr_t alloc_ep_ring(xhci_t *self, int slot_id, int epno) {
         ring_context *ctx = &self->tr_ctx[i];
         if (ctx->tr_base == 0) {
             int pcs = 1;
-            uint64_t base = moe_alloc_physical_page(size);
-            memset(MOE_PA2VA(base), 0, size);
+            MOE_PHYSICAL_ADDRESS base;
+            if (!moe_dma_pool_alloc(self->ring_pool, &base)) return 0;
             ctx->tr_base = base;
             if (!ctx->sem) {
                 ctx->sem = moe_sem_create(0);
@@ -175,6 +178,27 @@ static uintptr_t alloc_ep_ring(xhci_t *self, int slot_id, int epno) {
     return 0;
 }
 
+// Returns the contexts and rings of a disabled slot to the pools
+static void release_slot(xhci_t *self, int slot_id) {
+    uint64_t device_context = self->DCBAA[slot_id];
+    self->DCBAA[slot_id] = 0;
+    if (device_context) {
+        moe_dma_pool_free(self->context_pool, MOE_PA2VA(device_context));
+    }
+    usb_device_context *usb_device = &self->usb_devices[slot_id];
+    if (usb_device->input_context) {
+        moe_dma_pool_free(self->input_pool, MOE_PA2VA(usb_device->input_context));
+        usb_device->input_context = 0;
+    }
+    for (int i = 0; i < MAX_TR; i++) {
+        ring_context *ctx = &self->tr_ctx[i];
+        if (ctx->tr_base != 0 && ctx->slot_id == slot_id) {
+            moe_dma_pool_free(self->ring_pool, MOE_PA2VA(ctx->tr_base));
+            ctx->tr_base = 0;
+        }
+    }
+}
+
 
 static void copy_trb(xhci_trb_t *buffer, const xhci_trb_t *trb, int cycle) {
     _Atomic uint32_t *p = (void *)buffer;
@@ -285,13 +309,30 @@ int schedule_transfer(xhci_t *self, moe_semaphore_t *semaphore, int slot_id, int
 
 
 int execute_command(xhci_t *self, moe_semaphore_t *semaphore, xhci_trb_t *trb, xhci_trb_t *response) {
-    static moe_spinlock_t lock = 0;
-    moe_spinlock_acquire(&lock);
+    moe_sem_wait(self->sem_command, MOE_FOREVER);
     int result = schedule_transfer(self, semaphore, 0, 0, trb, response, 1);
-    moe_spinlock_release(&lock);
+    moe_sem_signal(self->sem_command);
     return result;
 }
 
+// Allocates the contexts of a newly enabled slot and returns the input context, or disables the slot again and returns 0
+static MOE_PHYSICAL_ADDRESS alloc_slot_contexts(xhci_t *self, int slot_id) {
+    MOE_PHYSICAL_ADDRESS device_context, input_context;
+    if (moe_dma_pool_alloc(self->context_pool, &device_context)) {
+        self->DCBAA[slot_id] = device_context;
+        if (moe_dma_pool_alloc(self->input_pool, &input_context)) {
+            self->usb_devices[slot_id].input_context = input_context;
+            return input_context;
+        }
+    }
+    xhci_trb_t cmd = trb_create(TRB_DISABLE_SLOT_COMMAND);
+    xhci_trb_t result;
+    cmd.enable_slot_command.slot_id = slot_id;
+    execute_command(self, self->sem_urb, &cmd, &result);
+    release_slot(self, slot_id);
+    return 0;
+}
+
 
 uint64_t configure_endpoint(xhci_t *self, int slot_id, uint32_t dci, uint32_t ep_type, uint32_t max_packet_size, uint32_t interval, int copy_dc) {
 
@@ -616,18 +657,11 @@ usb_host_interface_t *uhi_hub_attach_device(usb_host_interface_t *hub, int port_
     }
     int slot_id = result.cce.slot_id;
 
-    usb_device_context *usb_device = &self->usb_devices[slot_id];
-
-    size_t size_device_context = self->context_size * 32;
-    uint64_t device_context = moe_alloc_physical_page(size_device_context);
-    memset(MOE_PA2VA(device_context), 0, size_device_context);
-    self->DCBAA[slot_id] = device_context;
-
-    size_t size_input_context = self->context_size * 33;
-    uint64_t input_context = moe_alloc_physical_page(size_input_context);
-    xhci_input_control_ctx_t *icc = MOE_PA2VA(input_context);
-    memset(icc, 0, size_input_context);
-    usb_device->input_context = input_context;
+    MOE_PHYSICAL_ADDRESS input_context = alloc_slot_contexts(self, slot_id);
+    if (!input_context) {
+        DEBUG_PRINT("\n[NO CONTEXT FOR SLOT %d PORT %d]", slot_id, port_id);
+        return NULL;
+    }
 
     xhci_slot_ctx_data_t *slot = MOE_PA2VA(input_context + self->context_size);
     slot->speed = speed;
@@ -683,7 +717,7 @@ void uhi_hub_detach_device(usb_host_interface_t *hci) {
     cmd.enable_slot_command.slot_id = slot_id;
     int status = execute_command(self, self->sem_urb, &cmd, &result);
     (void)status;
-    self->DCBAA[slot_id] = 0;
+    release_slot(self, slot_id);
 }
 
 void uhi_enter_configuration(usb_host_interface_t *hci) {
@@ -725,6 +759,11 @@ int xhci_init_dev(xhci_t *self) {
 
     uint32_t HCCPARAMS1 = self->cap->hccparams1;
     self->context_size = (HCCPARAMS1 & USB_HCCP_CSZ) ? 64 : 32;
+
+    // Rings must not cross 64KB and contexts must not cross the controller's page
+    self->ring_pool = moe_dma_pool_create("xhci.ring", (MAX_TR_INDEX + 1) * sizeof(xhci_trb_t), 64, 0x10000);
+    self->context_pool = moe_dma_pool_create("xhci.context", self->context_size * 32, 64, self->min_pagesize);
+    self->input_pool = moe_dma_pool_create("xhci.input", self->context_size * 33, 64, self->min_pagesize);
     uint32_t xecp_ptr = (HCCPARAMS1 >> 16) << 2;
     uint64_t xecp_base = self->base_address + xecp_ptr;
     while (xecp_ptr) {
@@ -776,7 +815,7 @@ int xhci_init_dev(xhci_t *self) {
     uintptr_t SCRPAD_PA = 0;
     if (scrpad_size) {
         size_t scrpad_raw_size = scrpad_size * self->min_pagesize;
-        SCRPAD_PA = moe_alloc_physical_page(scrpad_raw_size);
+        SCRPAD_PA = moe_alloc_io_buffer(scrpad_raw_size);
         memset(MOE_PA2VA(SCRPAD_PA), 0, scrpad_raw_size);
     }
 
@@ -784,7 +823,7 @@ int xhci_init_dev(xhci_t *self) {
     self->max_dev_slot = MIN(max_dev_slot, MAX_SLOTS);
     size_t size_dcbaa = (1 + self->max_dev_slot) * 8;
     self->usb_devices = moe_alloc_object(sizeof(usb_device_context), 1 + self->max_dev_slot);
-    uintptr_t DCBAA_PA = moe_alloc_physical_page(size_dcbaa);
+    uintptr_t DCBAA_PA = moe_alloc_io_buffer(size_dcbaa);
     self->DCBAA = MOE_PA2VA(DCBAA_PA);
     memset(self->DCBAA, 0, size_dcbaa);
     self->DCBAA[0] = SCRPAD_PA;
@@ -797,10 +836,10 @@ int xhci_init_dev(xhci_t *self) {
 
     // Event Ring Segment Table
     self->event_cycle = 1;
-    uintptr_t ERS_PA = moe_alloc_physical_page(4096);
+    uintptr_t ERS_PA = moe_alloc_io_buffer(4096);
     self->ERS0 = MOE_PA2VA(ERS_PA);
     memset(self->ERS0, 0, 4096);
-    uintptr_t ERST_PA = moe_alloc_physical_page(4096);
+    uintptr_t ERST_PA = moe_alloc_io_buffer(4096);
     xhci_erste_t *erst = MOE_PA2VA(ERST_PA);
     xhci_erste_t erst0 = { ERS_PA, SIZE_EVENT_RING };
     erst[0] = erst0;
@@ -979,20 +1018,13 @@ static int port_initialize(xhci_t *self, int port_id) {
                 return 0;
             }
             int slot_id = result.cce.slot_id;
-            self->port2slot[port_id] = slot_id;
-
-            usb_device_context *usb_device = &self->usb_devices[slot_id];
 
-            size_t size_device_context = self->context_size * 32;
-            uint64_t device_context = moe_alloc_physical_page(size_device_context);
-            memset(MOE_PA2VA(device_context), 0, size_device_context);
-            self->DCBAA[slot_id] = device_context;
-
-            size_t size_input_context = self->context_size * 33;
-            uint64_t input_context = moe_alloc_physical_page(size_input_context);
-            xhci_input_control_ctx_t *icc = MOE_PA2VA(input_context);
-            memset(icc, 0, size_input_context);
-            usb_device->input_context = input_context;
+            MOE_PHYSICAL_ADDRESS input_context = alloc_slot_contexts(self, slot_id);
+            if (!input_context) {
+                DEBUG_PRINT("\n[NO CONTEXT FOR SLOT %d PORT %d]", slot_id, port_id);
+                return 0;
+            }
+            self->port2slot[port_id] = slot_id;
 
             xhci_slot_ctx_data_t *slot = MOE_PA2VA(input_context + self->context_size);
             slot->root_hub_port_no = port_id;
@@ -1030,7 +1062,7 @@ static int port_initialize(xhci_t *self, int port_id) {
                 cmd.enable_slot_command.slot_id = slot_id;
                 int status = execute_command(self, self->sem_urb, &cmd, &result);
                 self->port2slot[port_id] = 0;
-                self->DCBAA[slot_id] = 0;
+                release_slot(self, slot_id);
                 if (status) {
                     DEBUG_PRINT("\n[DISABLE SLOT PORT %d TIMED_OUT]", port_id);
                 } else {
@@ -1103,7 +1135,8 @@ void xhci_init() {
         xhci.sem_urb = moe_sem_create(0);
         xhci.sem_control = moe_sem_create(1);
         xhci.sem_config_mode = moe_sem_create(1);
-        xhci.port_change_queue = moe_queue_create(MAX_PORT_CHANGE);
+        xhci.sem_command = moe_sem_create(1);
+        xhci.port_change_queue = moe_queue_create_with_flags(MAX_PORT_CHANGE, MOE_QUEUE_SINGLE_PRODUCER | MOE_QUEUE_SINGLE_CONSUMER);
         xhci.urbs = moe_alloc_object(sizeof(usb_request_block_t), MAX_URB);
 
         moe_create_process(&xhci_event_thread, priority_realtime, &xhci, "xhci.event");
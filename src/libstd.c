@@ -71,6 +71,19 @@ int strncmp(const char *s1, const char *s2, size_t n) {
     return (int)*s1 - (int)*s2;
 }
 
+int atoi(const char *s) {
+    int sign = 1, value = 0;
+    while (*s == ' ') { s++; }
+    if (*s == '-') {
+        sign = -1;
+        s++;
+    }
+    for (; *s >= '0' && *s <= '9'; s++) {
+        value = value * 10 + (*s - '0');
+    }
+    return sign * value;
+}
+
 
 size_t wcslen(const wchar_t *s) {
     size_t count = 0;